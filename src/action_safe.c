@@ -2,9 +2,11 @@
  * This file handles non-fighting player actions.
  */
 #include <sys/types.h>
+#include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
 
 /* include main header file */
 #include "mud.h"
@@ -41,9 +43,19 @@ void cmd_shutdown(D_MOBILE *dMob, char *arg)
 
 void cmd_commands(D_MOBILE *dMob, char *arg)
 {
-  BUFFER *buf = buffer_new(MAX_BUFFER);
+  /* the command table never changes, so we render the list once per level */
+  static TEMPLATE cmd_list[LEVEL_GOD + 1];
+  BUFFER *buf;
   int i, col = 0;
 
+  if (dMob->level >= 0 && dMob->level <= LEVEL_GOD && cmd_list[dMob->level].data)
+  {
+    template_to_mobile(dMob, &cmd_list[dMob->level], NULL);
+    return;
+  }
+
+  buf = buffer_new(MAX_BUFFER);
+
   bprintf(buf, "    - - - - ----==== The full command list ====---- - - - -\n\n\r");
   for (i = 0; tabCmd[i].cmd_name[0] != '\0'; i++)
   {
@@ -53,7 +65,11 @@ void cmd_commands(D_MOBILE *dMob, char *arg)
     if (!(++col % 4)) bprintf(buf, "\n\r");
   }
   if (col % 4) bprintf(buf, "\n\r");
-  text_to_mobile(dMob, buf->data);
+
+  if (dMob->level >= 0 && dMob->level <= LEVEL_GOD)
+    template_to_mobile(dMob, &cmd_list[dMob->level], buf->data);
+  else
+    text_to_mobile(dMob, buf->data);
   buffer_free(buf);
 }
 
@@ -120,7 +136,7 @@ void cmd_compress(D_MOBILE *dMob, char *arg)
     return;
 
   /* enable compression */
-  if (!dMob->socket->out_compress)
+  if (!__atomic_load_n(&dMob->socket->compressing, __ATOMIC_ACQUIRE))
   {
     text_to_mobile(dMob, "Trying compression.\n\r");
     text_to_buffer(dMob->socket, (char *) compress_will2);
@@ -128,11 +144,7 @@ void cmd_compress(D_MOBILE *dMob, char *arg)
   }
   else /* disable compression */
   {
-    if (!compressEnd(dMob->socket, dMob->socket->compressing, FALSE))
-    {
-      text_to_mobile(dMob, "Failed.\n\r");
-      return;
-    }
+    net_post(dMob->socket, NET_MSG_COMPRESS_END, NULL, 0);
     text_to_mobile(dMob, "Compression disabled.\n\r");
   }
 }
@@ -148,7 +160,10 @@ void cmd_copyover(D_MOBILE *dMob, char *arg)
   FILE *fp;
   ITERATOR Iter;
   D_SOCKET *dsock;
-  char buf[MAX_BUFFER];
+  char buf[MAX_BUFFER], threads[MAX_BUFFER], maxoutput[MAX_BUFFER];
+  char fds[REACTOR_LISTENERS][20];
+  char *argv[8 + 2 * REACTOR_LISTENERS];
+  int argc, i;
   
   if ((fp = fopen(COPYOVER_FILE, "w")) == NULL)
   {
@@ -156,13 +171,17 @@ void cmd_copyover(D_MOBILE *dMob, char *arg)
     return;
   }
 
+  /* stop the network threads, we do the last io ourself */
+  net_stop();
+  handle_net_messages();
+
   strncpy(buf, "\n\r <*>            The world starts spinning             <*>\n\r", MAX_BUFFER);
 
   /* For each playing descriptor, save its state */
   AttachIterator(&Iter, dsock_list);
   while ((dsock = (D_SOCKET *) NextInList(&Iter)) != NULL)
   {
-    compressEnd(dsock, dsock->compressing, FALSE);
+    net_post(dsock, NET_MSG_COMPRESS_END, NULL, 0);
 
     if (dsock->state != STATE_PLAYING)
     {
@@ -174,10 +193,14 @@ void cmd_copyover(D_MOBILE *dMob, char *arg)
       fprintf(fp, "%d %s %s\n",
         dsock->control, dsock->player->name, dsock->hostname);
 
+      /* accept4() set close-on-exec, but this one must survive */
+      fcntl(dsock->control, F_SETFD, 0);
+
       /* save the player */
       save_player(dsock->player);
 
       text_to_socket(dsock, buf);
+      send_output(dsock);
     }
   }
   DetachIterator(&Iter);
@@ -185,18 +208,43 @@ void cmd_copyover(D_MOBILE *dMob, char *arg)
   fprintf (fp, "-1\n");
   fclose (fp);
 
+  /* keep the hostnames we already know */
+  save_dns_cache();
+
+  /* make sure everything we just wrote has been sent */
+  net_stop();
+
   /* close any pending sockets */
+  handle_net_messages();
   recycle_sockets();
-  
+
   /*
-   * feel free to add any additional arguments between the 2nd and 3rd,
-   * that is "SocketMud" and buf, but leave the last three in that order,
-   * to ensure that the main() function can parse the input correctly.
+   * feel free to add any additional arguments after "SocketMud",
+   * but leave "copyover" as the last one, and pass every listener
+   * with -listenfd, to ensure that main() can parse the input correctly.
    */
-  snprintf(buf, MAX_BUFFER, "%d", control);
-  execl(EXE_FILE, "SocketMud", buf, "copyover", (char *) NULL);
+  argc = 0;
+  argv[argc++] = "SocketMud";
+  if (reactor->backend == REACTOR_URING)
+    argv[argc++] = "-uring";
+  snprintf(threads, MAX_BUFFER, "%d", net_thread_count());
+  argv[argc++] = "-threads";
+  argv[argc++] = threads;
+  snprintf(maxoutput, MAX_BUFFER, "%d", max_output);
+  argv[argc++] = "-maxoutput";
+  argv[argc++] = maxoutput;
+  for (i = 0; i < listener_count; i++)
+  {
+    snprintf(fds[i], sizeof(fds[i]), "%d", listeners[i]);
+    argv[argc++] = "-listenfd";
+    argv[argc++] = fds[i];
+  }
+  argv[argc++] = "copyover";
+  argv[argc] = NULL;
+  execv(EXE_FILE, argv);
 
   /* Failed - sucessful exec will not return */
+  net_start();
   text_to_mobile(dMob, "Copyover FAILED!\n\r");
 }
 
@@ -222,3 +270,167 @@ void cmd_linkdead(D_MOBILE *dMob, char *arg)
   if (!found)
     text_to_mobile(dMob, "Noone is currently linkdead.\n\r");
 }
+
+/*
+ * Shows every connection, and how much input and output
+ * it has waiting, so we can see who is queueing.
+ */
+void cmd_sockets(D_MOBILE *dMob, char *arg)
+{
+  D_SOCKET *dsock;
+  ITERATOR Iter;
+  BUFFER *buf = buffer_new(MAX_BUFFER);
+
+  bprintf(buf, " Name          Host                      Cmds   Peak   Output\n\r");
+  bprintf(buf, " ------------  ------------------------  -----  -----  --------\n\r");
+
+  AttachIterator(&Iter, dsock_list);
+  while ((dsock = (D_SOCKET *) NextInList(&Iter)) != NULL)
+  {
+    if (dsock->state == STATE_CLOSED) continue;
+
+    bprintf(buf, " %-12s  %-24.24s  %5d  %5d  %8d\n\r",
+      (dsock->player && dsock->player->name) ? dsock->player->name : "(none)",
+      dsock->hostname,
+      __atomic_load_n(&dsock->cmd_backlog, __ATOMIC_RELAXED),
+      dsock->cmd_peak,
+      send_queue_depth(dsock));
+  }
+  DetachIterator(&Iter);
+
+  text_to_mobile(dMob, buf->data);
+  buffer_free(buf);
+}
+
+/*
+ * Shows what each type of event has cost, and how many events
+ * are waiting in the event queue. With "buckets" it shows each
+ * bucket, starting with the next to come up, "dump" writes it
+ * all to a file, and "reset" clears the stats.
+ */
+void cmd_events(D_MOBILE *dMob, char *arg)
+{
+  BUFFER *buf;
+  EVENT_STATS *stats;
+  int count[EVENT_WHEEL_SIZE];
+  int level, lap, pulses = 1, total, ownertype, type;
+
+  if (!strcasecmp(arg, "reset"))
+  {
+    memset(event_stats, 0, sizeof(event_stats));
+    text_to_mobile(dMob, "Event stats cleared.\n\r");
+    return;
+  }
+
+  if (!strcasecmp(arg, "dump"))
+  {
+    if (save_event_stats())
+      text_to_mobile(dMob, "Event stats written to " EVENT_STATS_FILE ".\n\r");
+    else
+      text_to_mobile(dMob, "Could not write the event stats.\n\r");
+    return;
+  }
+
+  if (arg[0] != '\0' && strcasecmp(arg, "buckets"))
+  {
+    text_to_mobile(dMob, "Syntax: events [buckets | dump | reset]\n\r");
+    return;
+  }
+
+  buf = buffer_new(MAX_BUFFER);
+
+  if (arg[0] == '\0')
+  {
+    bprintf(buf, " Owner   Type   Runs      Avg usecs  Max usecs  Avg late ms  Max late ms\n\r");
+    bprintf(buf, " ------  -----  --------  ---------  ---------  -----------  -----------\n\r");
+
+    for (ownertype = 0; ownertype <= EVENT_OWNER_GAME; ownertype++)
+    {
+      for (type = 0; type <= MAX_EVENT_TYPE; type++)
+      {
+        stats = &event_stats[ownertype][type];
+        if (event_type_name(ownertype, type) == NULL || stats->runs == 0)
+          continue;
+
+        bprintf(buf, " %-6s  %-5s  %8lld  %9.1f  %9.1f  %11.2f  %11.2f\n\r",
+          event_owner_name(ownertype), event_type_name(ownertype, type), stats->runs,
+          stats->nsecs / 1000.0 / stats->runs, stats->max_nsecs / 1000.0,
+          stats->late / 1000000.0 / stats->runs, stats->max_late / 1000000.0);
+      }
+    }
+    bprintf(buf, "\n\r");
+  }
+
+  for (level = 0; level < EVENT_WHEEL_LEVELS; level++, pulses *= EVENT_WHEEL_SIZE)
+  {
+    for (lap = 0, total = 0; lap < EVENT_WHEEL_SIZE; lap++)
+      total += (count[lap] = events_in_bucket(level, lap));
+
+    bprintf(buf, " Level %d, %d pulses (%g seconds) per bucket, %d events.\n\r",
+      level, pulses, (double) pulses / PULSES_PER_SECOND, total);
+
+    if (total == 0 || arg[0] == '\0') continue;
+
+    for (lap = 0; lap < EVENT_WHEEL_SIZE; lap++)
+      bprintf(buf, "%5d%s", count[lap], (lap % 16 == 15) ? "\n\r" : "");
+    bprintf(buf, "\n\r");
+  }
+
+  text_to_mobile(dMob, buf->data);
+  buffer_free(buf);
+}
+
+/*
+ * Shows what each MCCP level has saved us, and what it cost,
+ * and lets us fix the level, or leave it to follow the load.
+ */
+void cmd_mccp(D_MOBILE *dMob, char *arg)
+{
+  BUFFER *buf;
+  long long in, out, nsecs;
+  int level;
+
+  if (!strcasecmp(arg, "auto"))
+  {
+    mccp_auto = TRUE;
+    text_to_mobile(dMob, "The MCCP level now follows the load.\n\r");
+    return;
+  }
+
+  if (arg[0] != '\0')
+  {
+    level = atoi(arg);
+    if (level < MCCP_LEVEL_MIN || level > MCCP_LEVEL_MAX)
+    {
+      text_to_mobile(dMob, "Syntax: mccp [auto | <level>]\n\r");
+      return;
+    }
+
+    mccp_auto = FALSE;
+    __atomic_store_n(&mccp_level, level, __ATOMIC_RELAXED);
+    text_to_mobile(dMob, "MCCP level set.\n\r");
+    return;
+  }
+
+  buf = buffer_new(MAX_BUFFER);
+  bprintf(buf, " MCCP level %d (%s), the game is %d%% busy.\n\r\n\r",
+    mccp_level, mccp_auto ? "automatic" : "fixed", mccp_busy);
+  bprintf(buf, " Level  In KB       Out KB      Saved  Msecs     KB saved/ms\n\r");
+  bprintf(buf, " -----  ----------  ----------  -----  --------  -----------\n\r");
+
+  for (level = MCCP_LEVEL_MIN; level <= MCCP_LEVEL_MAX; level++)
+  {
+    in    = __atomic_load_n(&mccp_stats[level].bytes_in, __ATOMIC_RELAXED);
+    out   = __atomic_load_n(&mccp_stats[level].bytes_out, __ATOMIC_RELAXED);
+    nsecs = __atomic_load_n(&mccp_stats[level].nsecs, __ATOMIC_RELAXED);
+
+    if (in == 0) continue;
+
+    bprintf(buf, " %5d  %10lld  %10lld  %4lld%%  %8lld  %11.1f\n\r",
+      level, in / 1024, out / 1024, (in - out) * 100 / in, nsecs / 1000000,
+      (in - out) / 1024.0 / UMAX(nsecs / 1000000.0, 0.001));
+  }
+
+  text_to_mobile(dMob, buf->data);
+  buffer_free(buf);
+}
@@ -0,0 +1,363 @@
+/*
+ * This file contains the resolver pool. A fixed number of
+ * threads take reverse lookups from a queue, and pass the
+ * hostnames they find back to the game thread, which keeps
+ * them in a cache so repeat connections are resolved at once.
+ * The cache is only ever touched by the game thread.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <time.h>
+
+/* including main header file */
+#include "mud.h"
+
+/* local variables */
+DNS_REQUEST    * dns_first = NULL;     /* the next lookup to make             */
+DNS_REQUEST    * dns_last = NULL;      /* the last lookup in the queue        */
+int              dns_queued = 0;       /* how many lookups are waiting        */
+pthread_mutex_t  dns_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t   dns_cond = PTHREAD_COND_INITIALIZER;
+DNS_ENTRY      * dns_hash[DNS_CACHE_HASH];
+DNS_ENTRY      * dns_newest = NULL;    /* the most recently used entry        */
+DNS_ENTRY      * dns_oldest = NULL;    /* the least recently used entry       */
+int              dns_cached = 0;       /* how many entries are in the cache   */
+
+/* local procedures */
+void     *dns_thread_loop       ( void *arg );
+int       dns_hash_key          ( const char *address );
+DNS_ENTRY*dns_find              ( const char *address );
+void      dns_touch             ( DNS_ENTRY *entry );
+void      dns_unlink            ( DNS_ENTRY *entry );
+void      dns_store             ( const char *address, const char *name, time_t expires );
+
+/*
+ * Init_dns()
+ *
+ * Starts the resolver threads. They live for as long as
+ * the program does, and simply die on a copyover.
+ */
+void init_dns()
+{
+  pthread_attr_t attr;
+  pthread_t thread;
+  int i;
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+  for (i = 0; i < DNS_THREADS; i++)
+  {
+    if (pthread_create(&thread, &attr, &dns_thread_loop, NULL) != 0)
+    {
+      bug("Init_dns: Cannot start resolver thread.");
+      abort();
+    }
+  }
+
+  pthread_attr_destroy(&attr);
+}
+
+/*
+ * Dns_thread_loop()
+ *
+ * Takes lookups from the queue, one at a time, and posts
+ * the result to the game. A failed lookup posts no name.
+ */
+void *dns_thread_loop(void *arg)
+{
+  DNS_REQUEST *req;
+  char name[NI_MAXHOST];
+
+  for (;;)
+  {
+    pthread_mutex_lock(&dns_lock);
+    while (dns_first == NULL)
+      pthread_cond_wait(&dns_cond, &dns_lock);
+    req = dns_first;
+    if ((dns_first = req->next) == NULL)
+      dns_last = NULL;
+    dns_queued--;
+    pthread_mutex_unlock(&dns_lock);
+
+    if (getnameinfo((struct sockaddr *) &req->addr, req->addrlen, name, sizeof(name), NULL, 0, NI_NAMEREQD) == 0)
+      net_post_game(req->dsock, NET_MSG_RESOLVED, name, strlen(name));
+    else
+      net_post_game(req->dsock, NET_MSG_RESOLVED, NULL, 0);
+
+    free(req);
+  }
+
+  return NULL;
+}
+
+/*
+ * Dns_lookup()
+ *
+ * Called by the game when a new socket connects, after the
+ * numeric address has been stored as the hostname. The socket
+ * leaves TSTATE_LOOKUP either right away, if the cache knows
+ * the address or we cannot look it up, or when the result
+ * comes back in dns_resolved().
+ */
+void dns_lookup(D_SOCKET *dsock, struct sockaddr_storage *addr, socklen_t addrlen)
+{
+  DNS_ENTRY *entry;
+  DNS_REQUEST *req;
+
+  /* no need to look up ourself */
+  if (!strcmp(dsock->hostname, "127.0.0.1") || !strcmp(dsock->hostname, "::1"))
+  {
+    dsock->lookup_status++;
+    return;
+  }
+
+  /* do we already know this one ? */
+  if ((entry = dns_find(dsock->hostname)) != NULL)
+  {
+    dns_touch(entry);
+    if (entry->name)
+    {
+      free(dsock->hostname);
+      dsock->hostname = strdup(entry->name);
+    }
+    dsock->lookup_status++;
+    return;
+  }
+
+  /* too many lookups waiting, just use the address */
+  if (dns_queued >= DNS_MAX_QUEUE)
+  {
+    dsock->lookup_status++;
+    return;
+  }
+
+  if ((req = malloc(sizeof(*req))) == NULL)
+  {
+    bug("Dns_lookup: Cannot allocate memory for lookup.");
+    abort();
+  }
+  req->next    = NULL;
+  req->dsock   = dsock;
+  req->addr    = *addr;
+  req->addrlen = addrlen;
+
+  pthread_mutex_lock(&dns_lock);
+  if (dns_last)
+    dns_last->next = req;
+  else
+    dns_first = req;
+  dns_last = req;
+  dns_queued++;
+  pthread_cond_signal(&dns_cond);
+  pthread_mutex_unlock(&dns_lock);
+}
+
+/*
+ * Dns_resolved()
+ *
+ * The game has been told the result of a lookup. The socket
+ * still has its numeric address as hostname, and may have been
+ * closed while we waited, in which case it is now ready to be
+ * recycled.
+ */
+void dns_resolved(D_SOCKET *dsock, const char *name)
+{
+  /* remember the answer, even if we found nothing */
+  dns_store(dsock->hostname, name,
+    current_time + (name ? DNS_CACHE_TTL : DNS_NEGATIVE_TTL));
+
+  if (name && dsock->lookup_status == TSTATE_LOOKUP)
+  {
+    free(dsock->hostname);
+    dsock->hostname = strdup(name);
+  }
+
+  /* set it ready to be closed or used */
+  dsock->lookup_status++;
+}
+
+int dns_hash_key(const char *address)
+{
+  unsigned int key = 5381;
+
+  while (*address)
+    key = key * 33 + (unsigned char) *address++;
+
+  return key % DNS_CACHE_HASH;
+}
+
+/*
+ * Dns_find()
+ *
+ * Returns the cache entry for an address, or NULL if there is
+ * none. Expired entries are thrown away as we find them.
+ */
+DNS_ENTRY *dns_find(const char *address)
+{
+  DNS_ENTRY *entry;
+
+  for (entry = dns_hash[dns_hash_key(address)]; entry; entry = entry->next_hash)
+  {
+    if (strcmp(entry->address, address))
+      continue;
+
+    if (entry->expires <= current_time)
+    {
+      dns_unlink(entry);
+      return NULL;
+    }
+    return entry;
+  }
+
+  return NULL;
+}
+
+/* moves an entry to the front of the LRU list */
+void dns_touch(DNS_ENTRY *entry)
+{
+  if (entry == dns_newest)
+    return;
+
+  /* take it out */
+  entry->prev_lru->next_lru = entry->next_lru;
+  if (entry->next_lru)
+    entry->next_lru->prev_lru = entry->prev_lru;
+  else
+    dns_oldest = entry->prev_lru;
+
+  /* and put it in front */
+  entry->prev_lru = NULL;
+  entry->next_lru = dns_newest;
+  dns_newest->prev_lru = entry;
+  dns_newest = entry;
+}
+
+/* removes an entry from the cache and frees it */
+void dns_unlink(DNS_ENTRY *entry)
+{
+  DNS_ENTRY **prev;
+
+  for (prev = &dns_hash[dns_hash_key(entry->address)]; *prev; prev = &(*prev)->next_hash)
+  {
+    if (*prev == entry)
+    {
+      *prev = entry->next_hash;
+      break;
+    }
+  }
+
+  if (entry->prev_lru)
+    entry->prev_lru->next_lru = entry->next_lru;
+  else
+    dns_newest = entry->next_lru;
+  if (entry->next_lru)
+    entry->next_lru->prev_lru = entry->prev_lru;
+  else
+    dns_oldest = entry->prev_lru;
+
+  free(entry->address);
+  free(entry->name);
+  free(entry);
+  dns_cached--;
+}
+
+/*
+ * Dns_store()
+ *
+ * Adds a lookup result to the cache, replacing any older
+ * result for the address, and dropping the least recently
+ * used entry if the cache is full.
+ */
+void dns_store(const char *address, const char *name, time_t expires)
+{
+  DNS_ENTRY *entry;
+  int key;
+
+  if ((entry = dns_find(address)) != NULL)
+    dns_unlink(entry);
+
+  if (dns_cached >= DNS_CACHE_SIZE)
+    dns_unlink(dns_oldest);
+
+  if ((entry = malloc(sizeof(*entry))) == NULL)
+  {
+    bug("Dns_store: Cannot allocate memory for cache entry.");
+    abort();
+  }
+  entry->address = strdup(address);
+  entry->name    = name ? strdup(name) : NULL;
+  entry->expires = expires;
+
+  key = dns_hash_key(address);
+  entry->next_hash = dns_hash[key];
+  dns_hash[key] = entry;
+
+  entry->prev_lru = NULL;
+  entry->next_lru = dns_newest;
+  if (dns_newest)
+    dns_newest->prev_lru = entry;
+  else
+    dns_oldest = entry;
+  dns_newest = entry;
+  dns_cached++;
+}
+
+/*
+ * Save_dns_cache()
+ *
+ * Writes the cache to DNS_CACHE_FILE before a copyover, oldest
+ * entry first, so loading it back keeps the LRU order.
+ */
+void save_dns_cache()
+{
+  DNS_ENTRY *entry;
+  FILE *fp;
+
+  if ((fp = fopen(DNS_CACHE_FILE, "w")) == NULL)
+  {
+    bug("Save_dns_cache: Cannot open %s.", DNS_CACHE_FILE);
+    return;
+  }
+
+  for (entry = dns_oldest; entry; entry = entry->prev_lru)
+    fprintf(fp, "%s %s %ld\n", entry->address,
+      entry->name ? entry->name : "-", (long) entry->expires);
+
+  fprintf(fp, "%s\n", FILE_TERMINATOR);
+  fclose(fp);
+}
+
+/*
+ * Load_dns_cache()
+ *
+ * Reads back the cache after a copyover. Anything which
+ * expired while we were rebooting is skipped.
+ */
+void load_dns_cache()
+{
+  char address[NI_MAXHOST], name[NI_MAXHOST];
+  long expires;
+  FILE *fp;
+
+  if ((fp = fopen(DNS_CACHE_FILE, "r")) == NULL)
+    return;
+
+  while (fscanf(fp, "%1024s %1024s %ld", address, name, &expires) == 3)
+  {
+    if (expires <= current_time)
+      continue;
+
+    dns_store(address, strcmp(name, "-") ? name : NULL, expires);
+  }
+
+  fclose(fp);
+  unlink(DNS_CACHE_FILE);
+}
@@ -0,0 +1,49 @@
+/* dns.h
+ *
+ * This file contains the resolver pool, which does reverse
+ * lookups on new connections, and the cache of lookup results.
+ * The resolver threads never touch a socket, they only pass
+ * the names they find back to the game thread.
+ */
+
+/* the number of resolver threads */
+#define DNS_THREADS              2
+
+/* lookups waiting for a resolver before we stop asking */
+#define DNS_MAX_QUEUE          256
+
+/* the cache, and how long its entries are trusted (in seconds) */
+#define DNS_CACHE_SIZE        1024
+#define DNS_CACHE_HASH         256
+#define DNS_CACHE_TTL         3600
+#define DNS_NEGATIVE_TTL       300
+
+/* where the cache is kept during a copyover */
+#define DNS_CACHE_FILE        "../txt/dnscache.dat"
+
+/* a lookup waiting for a resolver */
+struct dns_request
+{
+  DNS_REQUEST      * next;             /* the next request in the queue       */
+  D_SOCKET         * dsock;            /* the socket being looked up          */
+  struct sockaddr_storage addr;        /* the address to look up              */
+  socklen_t          addrlen;          /* the size of the address             */
+};
+
+/* a cached lookup, found by address and kept in LRU order */
+struct dns_entry
+{
+  DNS_ENTRY        * next_hash;        /* the next entry in the hash bucket   */
+  DNS_ENTRY        * prev_lru;         /* the entry used just after this one  */
+  DNS_ENTRY        * next_lru;         /* the entry used just before this one */
+  char             * address;          /* the numeric address                 */
+  char             * name;             /* the hostname, or NULL if none       */
+  time_t             expires;          /* when we should ask again            */
+};
+
+/* functions which can be accessed outside dns.c */
+void      init_dns               ( void );
+void      dns_lookup             ( D_SOCKET *dsock, struct sockaddr_storage *addr, socklen_t addrlen );
+void      dns_resolved           ( D_SOCKET *dsock, const char *name );
+void      save_dns_cache         ( void );
+void      load_dns_cache         ( void );
@@ -3,14 +3,26 @@
 #include <string.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <time.h>
 
 /* include main header file */
 #include "mud.h"
 
-LIST  *eventqueue[MAX_EVENT_HASH];
-STACK *event_free = NULL;
-LIST  *global_events = NULL;
-int    current_bucket = 0;
+EVENT_DATA *eventqueue[MAX_EVENT_HASH];
+int         event_count[MAX_EVENT_HASH];
+STACK      *event_free = NULL;
+EVENT_DATA *global_events = NULL;
+unsigned long event_pulse = 0;
+EVENT_STATS event_stats[EVENT_OWNER_GAME + 1][MAX_EVENT_TYPE + 1];
+
+/* local procedures */
+void         place_event      ( EVENT_DATA *event );
+void         unlink_event     ( EVENT_DATA *event );
+void         cascade_events   ( int bucket );
+int          event_phase      ( EVENT_DATA *event );
+long long    event_clock      ( void );
+EVENT_DATA **local_events     ( EVENT_DATA *event );
+void         attach_local     ( EVENT_DATA *event, EVENT_DATA **list );
 
 
 /* function   :: enqueue_event()
@@ -22,8 +34,6 @@ int    current_bucket = 0;
  */
 bool enqueue_event(EVENT_DATA *event, int game_pulses)
 {
-  int bucket, passes;
-
   /* check to see if the event has been attached to an owner */
   if (event->ownertype == EVENT_UNOWNED)
   {
@@ -31,27 +41,96 @@ bool enqueue_event(EVENT_DATA *event, int game_pulses)
     return FALSE;
   }
 
-  /* An event must be enqueued into the future */
+  /* An event must be enqueued into the future,
+   * but not further than the queue can reach.
+   */
   if (game_pulses < 1)
     game_pulses = 1;
+  else if (game_pulses > MAX_EVENT_DELAY)
+    game_pulses = MAX_EVENT_DELAY;
 
-  /* calculate which bucket to put the event in,
-   * and how many passes the event must stay in the queue.
-   */
-  bucket = (game_pulses + current_bucket) % MAX_EVENT_HASH;
-  passes = game_pulses / MAX_EVENT_HASH;
-
-  /* let the event store this information */
-  event->passes = passes;
-  event->bucket = bucket;
+  /* let the event store when it should execute */
+  event->when = event_pulse + game_pulses;
 
   /* attach the event in the queue */
-  AttachToList(event, eventqueue[bucket]);
+  place_event(event);
 
   /* success */
   return TRUE;
 }
 
+/* function   :: place_event()
+ * arguments  :: the event to place.
+ * ======================================================
+ * This function puts the event in the bucket it belongs
+ * in right now. Events which are close go in the first
+ * level, where each bucket is a single pulse, and events
+ * further away go in the level whose laps are just big
+ * enough to hold them.
+ */
+void place_event(EVENT_DATA *event)
+{
+  unsigned long delta = event->when - event_pulse;
+  int level = 0;
+
+  while (level < EVENT_WHEEL_LEVELS - 1 && delta >= (1UL << (EVENT_WHEEL_BITS * (level + 1))))
+    level++;
+
+  event->bucket = level * EVENT_WHEEL_SIZE +
+    ((event->when >> (EVENT_WHEEL_BITS * level)) & (EVENT_WHEEL_SIZE - 1));
+
+  /* link the event in front of the bucket */
+  event->prev = NULL;
+  if ((event->next = eventqueue[event->bucket]) != NULL)
+    event->next->prev = event;
+  eventqueue[event->bucket] = event;
+  event_count[event->bucket]++;
+}
+
+/* function   :: unlink_event()
+ * arguments  :: the event to unlink.
+ * ======================================================
+ * This function takes the event out of its bucket. It
+ * does not touch the owners local list.
+ */
+void unlink_event(EVENT_DATA *event)
+{
+  if (event->prev != NULL)
+    event->prev->next = event->next;
+  else
+    eventqueue[event->bucket] = event->next;
+
+  if (event->next != NULL)
+    event->next->prev = event->prev;
+
+  event->next = event->prev = NULL;
+  event_count[event->bucket]--;
+}
+
+/* function   :: cascade_events()
+ * arguments  :: the bucket to cascade.
+ * ======================================================
+ * This function moves all events in a bucket one or more
+ * levels down the wheel. It is called when the lap the
+ * bucket covers begins, so none of the events will end
+ * up back in the same bucket.
+ */
+void cascade_events(int bucket)
+{
+  EVENT_DATA *event, *event_next;
+
+  /* empty the bucket, and place the events it held */
+  event = eventqueue[bucket];
+  eventqueue[bucket] = NULL;
+  event_count[bucket] = 0;
+
+  for (; event != NULL; event = event_next)
+  {
+    event_next = event->next;
+    place_event(event);
+  }
+}
+
 /* function   :: dequeue_event()
  * arguments  :: the event to dequeue.
  * ======================================================
@@ -63,31 +142,84 @@ bool enqueue_event(EVENT_DATA *event, int game_pulses)
  */
 void dequeue_event(EVENT_DATA *event)
 {
-  /* dequeue from the bucket */
-  DetachFromList(event, eventqueue[event->bucket]);
+  EVENT_DATA **list;
+
+  /* dequeue from the bucket, unless it was taken off to execute */
+  if (event->bucket != EVENT_RUNNING)
+    unlink_event(event);
 
   /* dequeue from owners local list */
+  if ((list = local_events(event)) == NULL)
+    bug("dequeue_event: event type %d has no owner.", event->type);
+  else
+  {
+    if (event->prev_local != NULL)
+      event->prev_local->next_local = event->next_local;
+    else
+      *list = event->next_local;
+
+    if (event->next_local != NULL)
+      event->next_local->prev_local = event->prev_local;
+  }
+
+  /* free argument */
+  free(event->argument);
+
+  /* attach to free stack */
+  PushStack(event, event_free);
+}
+
+/* function   :: local_events()
+ * arguments  :: the event.
+ * ======================================================
+ * This function returns the head of the local list that
+ * the event belongs in, which depends on the owner.
+ */
+EVENT_DATA **local_events(EVENT_DATA *event)
+{
   switch(event->ownertype)
   {
     default:
-      bug("dequeue_event: event type %d has no owner.", event->type);
-      break;
+      return NULL;
     case EVENT_OWNER_GAME:
-      DetachFromList(event, global_events);
-      break;
+      return &global_events;
     case EVENT_OWNER_DMOB:
-      DetachFromList(event, event->owner.dMob->events);
-      break;
+      return &event->owner.dMob->events;
     case EVENT_OWNER_DSOCKET:
-      DetachFromList(event, event->owner.dSock->events);
-      break;
+      return &event->owner.dSock->events;
   }
+}
 
-  /* free argument */
-  free(event->argument);
+/* function   :: attach_local()
+ * arguments  :: the event and the local list.
+ * ======================================================
+ * This function links the event in front of the owners
+ * local list.
+ */
+void attach_local(EVENT_DATA *event, EVENT_DATA **list)
+{
+  event->prev_local = NULL;
+  if ((event->next_local = *list) != NULL)
+    event->next_local->prev_local = event;
+  *list = event;
+}
 
-  /* attach to free stack */
-  PushStack(event, event_free);
+/* function   :: reschedule_event()
+ * arguments  :: the event and the new delay.
+ * ======================================================
+ * This function moves an event which has _already_ been
+ * enqueued, so it executes in the given time instead. An
+ * event may reschedule itself from its own function, which
+ * must then return TRUE.
+ */
+void reschedule_event(EVENT_DATA *event, int delay)
+{
+  /* take it out of the bucket it is in now */
+  if (event->bucket != EVENT_RUNNING)
+    unlink_event(event);
+
+  if (enqueue_event(event, delay) == FALSE)
+    bug("reschedule_event: event type %d failed to be enqueued.", event->type);
 }
 
 /* function   :: alloc_event()
@@ -106,10 +238,17 @@ EVENT_DATA *alloc_event()
     event = (EVENT_DATA *) PopStack(event_free);
 
   /* clear the event */
+  event->next       = NULL;
+  event->prev       = NULL;
+  event->next_local = NULL;
+  event->prev_local = NULL;
   event->fun        = NULL;
   event->argument   = NULL;
   event->owner.dMob = NULL;  /* only need to NULL one of the union members */
-  event->passes     = 0;
+  event->when       = 0;
+  event->interval   = 0;
+  event->jitter     = 0;
+  event->stagger    = 0;
   event->bucket     = 0;
   event->ownertype  = EVENT_UNOWNED;
   event->type       = EVENT_NONE;
@@ -130,51 +269,73 @@ EVENT_DATA *alloc_event()
 void init_event_queue(int section)
 {
   EVENT_DATA *event;
-  int i;
 
   if (section == 1)
   {
-    for (i = 0; i < MAX_EVENT_HASH; i++)
-    {
-      eventqueue[i] = AllocList();
-    }
-
     event_free = AllocStack();
-    global_events = AllocList();
   }
   else if (section == 2)
   {
     event = alloc_event();
     event->fun = &event_game_tick;
     event->type = EVENT_GAME_TICK;
-    add_event_game(event, 10 * 60 * PULSES_PER_SECOND);
+    event->interval = 10 * 60 * PULSES_PER_SECOND;
+    add_event_game(event, event->interval);
   }
 }
 
 /* function   :: heartbeat()
- * arguments  :: none
+ * arguments  :: when the pulse was due
  * ======================================================
  * This function is called once per game pulse, and it will
  * check the queue, and execute any pending events, which
- * has been enqueued to execute at this specific time.
+ * has been enqueued to execute at this specific time. The
+ * due time is CLOCK_MONOTONIC in nanoseconds, and is only
+ * used to see how late each event is.
  */
-void heartbeat()
+void heartbeat(long long due)
 {
+  EVENT_STATS *stats;
   EVENT_DATA *event;
-  ITERATOR Iter;
+  long long start, end = 0;
+  int level, lap, bucket, ownertype, type;
+  bool done;
 
-  /* current_bucket should be global, it is also used in enqueue_event
+  /* event_pulse is global, it is also used in enqueue_event
    * to figure out what bucket to place the new event in.
    */
-  current_bucket = (current_bucket + 1) % MAX_EVENT_HASH;
+  event_pulse++;
 
-  AttachIterator(&Iter, eventqueue[current_bucket]);
-  while ((event = (EVENT_DATA *) NextInList(&Iter)) != NULL)
+  /* Each time a lap of a level is done, the next bucket of the level
+   * above is moved down. The higher levels only move when the level
+   * below them has finished a lap as well.
+   */
+  for (level = 1; level < EVENT_WHEEL_LEVELS; level++)
   {
-    /* Here we use the event->passes integer, to keep track of
-     * how many times we have ignored this event.
-     */
-    if (event->passes-- > 0) continue;
+    if ((event_pulse & ((1UL << (EVENT_WHEEL_BITS * level)) - 1)) != 0)
+      break;
+
+    lap = (event_pulse >> (EVENT_WHEEL_BITS * level)) & (EVENT_WHEEL_SIZE - 1);
+    cascade_events(level * EVENT_WHEEL_SIZE + lap);
+  }
+
+  /* Every event in this bucket is due now. Each event is taken
+   * off the queue before it executes, so the callback is free
+   * to dequeue any other event, including the next one here.
+   */
+  bucket = event_pulse & (EVENT_WHEEL_SIZE - 1);
+  if (eventqueue[bucket] != NULL)
+    end = event_clock();
+
+  while ((event = eventqueue[bucket]) != NULL)
+  {
+    unlink_event(event);
+    event->bucket = EVENT_RUNNING;
+
+    /* the event may be gone once it has executed */
+    ownertype = event->ownertype;
+    type = event->type;
+    start = end;
 
     /* execute event and extract if needed. We assume that all
      * event functions are of the following prototype
@@ -182,12 +343,31 @@ void heartbeat()
      * bool event_function ( EVENT_DATA *event );
      *
      * Any event returning TRUE is not dequeued, it is assumed
-     * that the event has dequeued itself.
+     * that the event has dequeued or rescheduled itself.
      */
-    if (!((*event->fun)(event)))
+    done = (*event->fun)(event);
+    end = event_clock();
+
+    /* count what the event cost */
+    if (ownertype >= 0 && ownertype <= EVENT_OWNER_GAME && type >= 0 && type <= MAX_EVENT_TYPE)
+    {
+      stats = &event_stats[ownertype][type];
+      stats->runs++;
+      stats->nsecs += end - start;
+      stats->max_nsecs = UMAX(stats->max_nsecs, end - start);
+      stats->late += start - due;
+      stats->max_late = UMAX(stats->max_late, start - due);
+    }
+
+    if (done)
+      continue;
+
+    /* periodic events are enqueued again, the same event is reused */
+    if (event->interval > 0)
+      enqueue_event(event, event->interval + number_range(-event->jitter, event->jitter));
+    else
       dequeue_event(event);
   }
-  DetachIterator(&Iter);
 }
 
 /* function   :: add_event_mobile()
@@ -218,10 +398,10 @@ void add_event_mobile(EVENT_DATA *event, D_MOBILE *dMob, int delay)
   event->owner.dMob = dMob;
 
   /* attach the event to the mobiles local list */
-  AttachToList(event, dMob->events);
+  attach_local(event, &dMob->events);
 
   /* attempt to enqueue the event */
-  if (enqueue_event(event, delay) == FALSE)
+  if (enqueue_event(event, delay + event_phase(event)) == FALSE)
     bug("add_event_mobile: event type %d failed to be enqueued.", event->type);
 }
 
@@ -253,10 +433,10 @@ void add_event_socket(EVENT_DATA *event, D_SOCKET *dSock, int delay)
   event->owner.dSock = dSock;
 
   /* attach the event to the sockets local list */
-  AttachToList(event, dSock->events);
+  attach_local(event, &dSock->events);
 
   /* attempt to enqueue the event */
-  if (enqueue_event(event, delay) == FALSE)
+  if (enqueue_event(event, delay + event_phase(event)) == FALSE)
     bug("add_event_socket: event type %d failed to be enqueued.", event->type);
 }
 
@@ -287,13 +467,175 @@ void add_event_game(EVENT_DATA *event, int delay)
   event->ownertype = EVENT_OWNER_GAME;
 
   /* attach the event to the gamelist */
-  AttachToList(event, global_events);
+  attach_local(event, &global_events);
 
   /* attempt to enqueue the event */
-  if (enqueue_event(event, delay) == FALSE)
+  if (enqueue_event(event, delay + event_phase(event)) == FALSE)
     bug("add_event_game: event type %d failed to be enqueued.", event->type);
 }
 
+/* function   :: event_phase()
+ * arguments  :: the event
+ * ======================================================
+ * This function returns how many pulses should be added
+ * to the first delay of a staggered event. The phase only
+ * depends on the owner and the type, so events added for
+ * many owners at once (like after a copyover) are spread
+ * over the stagger window, and each owner keeps the same
+ * place in it from one boot to the next.
+ */
+int event_phase(EVENT_DATA *event)
+{
+  unsigned int hash = event->type;
+  const char *name;
+
+  if (event->stagger <= 1)
+    return 0;
+
+  switch(event->ownertype)
+  {
+    default:
+      break;
+    case EVENT_OWNER_DMOB:
+      for (name = event->owner.dMob->name; name && *name; name++)
+        hash = hash * 33 + (unsigned char) *name;
+      break;
+    case EVENT_OWNER_DSOCKET:
+      hash = hash * 33 + event->owner.dSock->control;
+      break;
+  }
+
+  /* mix the bits, so similar names end up far apart */
+  hash ^= hash >> 16;
+  hash *= 0x45d9f3b;
+  hash ^= hash >> 16;
+
+  return hash % event->stagger;
+}
+
+/* function   :: events_in_bucket()
+ * arguments  :: the level of the wheel, and the bucket
+ * ======================================================
+ * This function returns how many events are in a bucket,
+ * which is kept up to date as events come and go. The bucket
+ * is given by how many buckets of its level will pass
+ * before it comes up, so 0 on the first level is the
+ * events which execute on the next pulse.
+ */
+int events_in_bucket(int level, int lap)
+{
+  int bucket;
+
+  bucket = level * EVENT_WHEEL_SIZE +
+    (((event_pulse >> (EVENT_WHEEL_BITS * level)) + 1 + lap) & (EVENT_WHEEL_SIZE - 1));
+
+  return event_count[bucket];
+}
+
+/* function   :: event_clock()
+ * arguments  :: none
+ * ======================================================
+ * This function returns CLOCK_MONOTONIC in nanoseconds,
+ * which is what the event stats are measured in.
+ */
+long long event_clock()
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (long long) now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/* function   :: event_owner_name()
+ * arguments  :: the type of owner
+ * ======================================================
+ * This function returns a name for the type of owner.
+ */
+const char *event_owner_name(int ownertype)
+{
+  switch(ownertype)
+  {
+    default:                  return "none";
+    case EVENT_OWNER_DSOCKET: return "socket";
+    case EVENT_OWNER_DMOB:    return "mobile";
+    case EVENT_OWNER_GAME:    return "game";
+  }
+}
+
+/* function   :: event_type_name()
+ * arguments  :: the type of owner and the type of event
+ * ======================================================
+ * This function returns a name for the type of event, or
+ * NULL if the owner has no such type. The type values are
+ * only unique for each type of owner, so both are needed.
+ */
+const char *event_type_name(int ownertype, int type)
+{
+  switch(ownertype)
+  {
+    default:
+      break;
+    case EVENT_OWNER_DSOCKET:
+      if (type == EVENT_SOCKET_IDLE) return "idle";
+      break;
+    case EVENT_OWNER_DMOB:
+      if (type == EVENT_MOBILE_SAVE) return "save";
+      break;
+    case EVENT_OWNER_GAME:
+      if (type == EVENT_GAME_TICK) return "tick";
+      break;
+  }
+
+  return NULL;
+}
+
+/* function   :: save_event_stats()
+ * arguments  :: none
+ * ======================================================
+ * This function writes the event stats and the number of
+ * events in each bucket to EVENT_STATS_FILE, one record
+ * on each line, as name=value pairs. Returns FALSE if the
+ * file could not be written.
+ */
+bool save_event_stats()
+{
+  EVENT_STATS *stats;
+  FILE *fp;
+  int ownertype, type, bucket;
+
+  if ((fp = fopen(EVENT_STATS_FILE, "w")) == NULL)
+  {
+    bug("save_event_stats: cannot open %s.", EVENT_STATS_FILE);
+    return FALSE;
+  }
+
+  fprintf(fp, "time=%ld pulse=%lu pulses_per_second=%d\n",
+    (long) current_time, event_pulse, PULSES_PER_SECOND);
+
+  for (ownertype = 0; ownertype <= EVENT_OWNER_GAME; ownertype++)
+  {
+    for (type = 0; type <= MAX_EVENT_TYPE; type++)
+    {
+      if (event_type_name(ownertype, type) == NULL)
+        continue;
+
+      stats = &event_stats[ownertype][type];
+      fprintf(fp, "event owner=%s type=%s runs=%lld nsecs=%lld max_nsecs=%lld late_nsecs=%lld max_late_nsecs=%lld\n",
+        event_owner_name(ownertype), event_type_name(ownertype, type), stats->runs,
+        stats->nsecs, stats->max_nsecs, stats->late, stats->max_late);
+    }
+  }
+
+  for (bucket = 0; bucket < MAX_EVENT_HASH; bucket++)
+  {
+    fprintf(fp, "bucket level=%d slot=%d queued=%d\n",
+      bucket / EVENT_WHEEL_SIZE, bucket % EVENT_WHEEL_SIZE, event_count[bucket]);
+  }
+
+  fclose(fp);
+  return TRUE;
+}
+
 /* function   :: event_isset_socket()
  * arguments  :: the socket and the type of event
  * ======================================================
@@ -304,15 +646,12 @@ void add_event_game(EVENT_DATA *event, int delay)
 EVENT_DATA *event_isset_socket(D_SOCKET *dSock, int type)
 {
   EVENT_DATA *event;
-  ITERATOR Iter;
 
-  AttachIterator(&Iter, dSock->events);
-  while ((event = (EVENT_DATA *) NextInList(&Iter)) != NULL)
+  for (event = dSock->events; event != NULL; event = event->next_local)
   {
     if (event->type == type)
       break;
   }
-  DetachIterator(&Iter);
 
   return event;
 }
@@ -327,15 +666,12 @@ EVENT_DATA *event_isset_socket(D_SOCKET *dSock, int type)
 EVENT_DATA *event_isset_mobile(D_MOBILE *dMob, int type)
 {
   EVENT_DATA *event;
-  ITERATOR Iter;
 
-  AttachIterator(&Iter, dMob->events);
-  while ((event = (EVENT_DATA *) NextInList(&Iter)) != NULL)
+  for (event = dMob->events; event != NULL; event = event->next_local)
   {
     if (event->type == type)
       break;
   }
-  DetachIterator(&Iter);
 
   return event;
 }
@@ -348,16 +684,15 @@ EVENT_DATA *event_isset_mobile(D_MOBILE *dMob, int type)
  */
 void strip_event_socket(D_SOCKET *dSock, int type)
 {
-  EVENT_DATA *event;
-  ITERATOR Iter;
+  EVENT_DATA *event, *event_next;
 
-  AttachIterator(&Iter, dSock->events);
-  while ((event = (EVENT_DATA *) NextInList(&Iter)) != NULL)
+  for (event = dSock->events; event != NULL; event = event_next)
   {
+    event_next = event->next_local;
+
     if (event->type == type)
       dequeue_event(event);
   }
-  DetachIterator(&Iter);
 }
 
 /* function   :: strip_event_mobile()
@@ -368,16 +703,15 @@ void strip_event_socket(D_SOCKET *dSock, int type)
  */
 void strip_event_mobile(D_MOBILE *dMob, int type)
 {
-  EVENT_DATA *event;
-  ITERATOR Iter;
+  EVENT_DATA *event, *event_next;
 
-  AttachIterator(&Iter, dMob->events);
-  while ((event = (EVENT_DATA *) NextInList(&Iter)) != NULL)
+  for (event = dMob->events; event != NULL; event = event_next)
   {
+    event_next = event->next_local;
+
     if (event->type == type)
       dequeue_event(event);
   }
-  DetachIterator(&Iter);
 }
 
 /* function   :: init_events_mobile()
@@ -394,7 +728,9 @@ void init_events_player(D_MOBILE *dMob)
   event = alloc_event();
   event->fun = &event_mobile_save;
   event->type = EVENT_MOBILE_SAVE;
-  add_event_mobile(event, dMob, 2 * 60 * PULSES_PER_SECOND);
+  event->interval = 2 * 60 * PULSES_PER_SECOND;
+  event->stagger = event->interval;
+  add_event_mobile(event, dMob, event->interval);
 }
 
 /* function   :: init_events_socket()
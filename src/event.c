@@ -13,21 +13,19 @@ bool event_game_tick(EVENT_DATA *event)
 {
   ITERATOR Iter;
   D_MOBILE *dMob;
+  SEGMENT *seg;
 
-  /* send a tick message to everyone */
+  /* render the tick once, and send it to everyone */
+  seg = render_segment("Tick!\n\r");
   AttachIterator(&Iter, dmobile_list);
   while ((dMob = (D_MOBILE *) NextInList(&Iter)) != NULL)
   {
-    text_to_mobile(dMob, "Tick!\n\r");
+    segment_to_mobile(dMob, seg);
   }
   DetachIterator(&Iter);
+  free_segment(seg);
 
-  /* enqueue another game tick in 10 minutes */
-  event = alloc_event();
-  event->fun = &event_game_tick;
-  event->type = EVENT_GAME_TICK;
-  add_event_game(event, 10 * 60 * PULSES_PER_SECOND);
-
+  /* the event is periodic, so we tick again in 10 minutes */
   return FALSE;
 }
 
@@ -48,12 +46,7 @@ bool event_mobile_save(EVENT_DATA *event)
   /* save the actual player file */
   save_player(dMob);
 
-  /* enqueue a new event to save the pfile in 2 minutes */
-  event = alloc_event();
-  event->fun = &event_mobile_save;
-  event->type = EVENT_MOBILE_SAVE;
-  add_event_mobile(event, dMob, 2 * 60 * PULSES_PER_SECOND);
-
+  /* the event is periodic, so we save again in 2 minutes */
   return FALSE;
 }
 
@@ -4,8 +4,25 @@
  * and specially defined values like MAX_EVENT_HASH.
  */
 
-/* the size of the event queue */
-#define MAX_EVENT_HASH        128
+/* The event queue is a timing wheel, with EVENT_WHEEL_LEVELS levels
+ * of EVENT_WHEEL_SIZE buckets. Each bucket in the first level is one
+ * pulse, each bucket in the next level is a full lap of the level
+ * below it, and so on. Events are moved a level down when their lap
+ * comes up, so an event is only looked at a few times before it runs.
+ */
+#define EVENT_WHEEL_BITS        6
+#define EVENT_WHEEL_SIZE        (1 << EVENT_WHEEL_BITS)
+#define EVENT_WHEEL_LEVELS      4
+
+/* the size of the event queue, and the longest delay it can hold */
+#define MAX_EVENT_HASH          (EVENT_WHEEL_SIZE * EVENT_WHEEL_LEVELS)
+#define MAX_EVENT_DELAY         ((1 << (EVENT_WHEEL_BITS * EVENT_WHEEL_LEVELS)) - 1)
+
+/* the bucket of an event which has been taken off the queue to execute */
+#define EVENT_RUNNING          -1
+
+/* where "events dump" writes the event stats */
+#define EVENT_STATS_FILE        "../log/events.txt"
 
 /* the different types of owners */
 #define EVENT_UNOWNED           0
@@ -35,18 +52,31 @@
  */
 #define EVENT_GAME_TICK         1
 
+/* the highest type value used by any owner */
+#define MAX_EVENT_TYPE          1
+
 /* the event prototype */
 typedef bool EVENT_FUN ( EVENT_DATA *event );
 
 /* the event structure */
 struct event_data
 {
+  EVENT_DATA       * next;             /* the next event in the same bucket   */
+  EVENT_DATA       * prev;             /* the previous event in the bucket    */
+  EVENT_DATA       * next_local;       /* the owner's next event              */
+  EVENT_DATA       * prev_local;       /* the owner's previous event          */
   EVENT_FUN        * fun;              /* the function being called           */
   char             * argument;         /* the text argument given (if any)    */
-  sh_int             passes;           /* how long before this event executes */
+  unsigned long      when;             /* the pulse this event executes on    */
   sh_int             type;             /* event type EVENT_XXX_YYY            */
   sh_int             ownertype;        /* type of owner (unlinking req)       */
-  sh_int             bucket;           /* which bucket is this event in       */
+  int                interval;         /* pulses between runs, 0 for one run  */
+  int                jitter;           /* most pulses added to or taken off   */
+                                       /* each interval, 0 for none           */
+  int                stagger;          /* spread the first run of this type   */
+                                       /* over so many pulses, 0 for none     */
+  sh_int             bucket;           /* which bucket is this event in, or   */
+                                       /* EVENT_RUNNING when it is executing  */
 
   union 
   {                                    /* this is the owner of the event, we  */
@@ -55,15 +85,32 @@ struct event_data
   } owner;
 };
 
+/* what the events of one owner and type have cost */
+typedef struct event_stats
+{
+  long long          runs;             /* how many times it has executed      */
+  long long          nsecs;            /* time spent in the event function    */
+  long long          max_nsecs;        /* the slowest run                     */
+  long long          late;             /* nsecs from when the pulse was due   */
+  long long          max_late;         /* the latest run                      */
+} EVENT_STATS;
+
+extern EVENT_STATS event_stats[EVENT_OWNER_GAME + 1][MAX_EVENT_TYPE + 1];
+
 /* functions which can be accessed outside event-handler.c */
 EVENT_DATA *alloc_event          ( void );
 EVENT_DATA *event_isset_socket   ( D_SOCKET *dSock, int type );
 EVENT_DATA *event_isset_mobile   ( D_MOBILE *dMob, int type );
 void dequeue_event               ( EVENT_DATA *event );
+void reschedule_event            ( EVENT_DATA *event, int delay );
+int  events_in_bucket            ( int level, int lap );
+const char *event_owner_name     ( int ownertype );
+const char *event_type_name      ( int ownertype, int type );
+bool save_event_stats            ( void );
 void init_event_queue            ( int section );
 void init_events_player          ( D_MOBILE *dMob );
 void init_events_socket          ( D_SOCKET *dSock );
-void heartbeat                   ( void );
+void heartbeat                   ( long long due );
 void add_event_mobile            ( EVENT_DATA *event, D_MOBILE *dMob, int delay );
 void add_event_socket            ( EVENT_DATA *event, D_SOCKET *dSock, int delay );
 void add_event_game              ( EVENT_DATA *event, int delay );
@@ -19,6 +19,11 @@
 LIST     *  help_list = NULL;   /* the linked list of help files     */
 char     *  greeting;           /* the welcome greeting              */
 char     *  motd;               /* the MOTD help file                */
+TEMPLATE    greeting_tpl;       /* the rendered greeting             */
+TEMPLATE    motd_tpl;           /* the rendered MOTD                 */
+
+/* local procedures */
+void      set_help_text         ( HELP_DATA *pHelp, char *text );
 
 /*
  * Check_help()
@@ -60,7 +65,8 @@ bool check_help(D_MOBILE *dMob, char *helpfile)
     if (last_modified(hFile) > pHelp->load_time)
     {
       free(pHelp->text);
-      pHelp->text = strdup(read_help_entry(hFile));
+      set_help_text(pHelp, strdup(read_help_entry(hFile)));
+      pHelp->load_time = time(NULL);
     }
   }
   else /* is there a version at all ?? */
@@ -79,14 +85,20 @@ bool check_help(D_MOBILE *dMob, char *helpfile)
         abort();
       }
       pHelp->keyword    =  strdup(hFile);
-      pHelp->text       =  strdup(entry);
       pHelp->load_time  =  time(NULL);
+      pHelp->tpl.data   =  NULL;
+      set_help_text(pHelp, strdup(entry));
       AttachToList(pHelp, help_list);
     }
   }
 
-  snprintf(buf, MAX_HELP_ENTRY + 80, "=== %s ===\n\r%s", pHelp->keyword, pHelp->text);
-  text_to_mobile(dMob, buf);
+  /* the entry is only rendered again when the file changes */
+  if (pHelp->tpl.data == NULL)
+  {
+    snprintf(buf, MAX_HELP_ENTRY + 80, "=== %s ===\n\r%s", pHelp->keyword, pHelp->text);
+    template_compile(&pHelp->tpl, buf);
+  }
+  template_to_mobile(dMob, &pHelp->tpl, NULL);
 
   return TRUE;
 }
@@ -128,14 +140,34 @@ void load_helps()
     }
 
     new_help->keyword    =  strdup(entry->d_name);
-    new_help->text       =  strdup(s);
     new_help->load_time  =  time(NULL);
+    new_help->tpl.data   =  NULL;
+    set_help_text(new_help, strdup(s));
     AttachToList(new_help, help_list);
-
-    if (!strcasecmp("GREETING", new_help->keyword))
-      greeting = new_help->text;
-    else if (!strcasecmp("MOTD", new_help->keyword))
-      motd = new_help->text;
   }
   closedir(directory);
 }
+
+/*
+ * Set_help_text()
+ *
+ * Gives a helpfile new text, and throws away the templates
+ * rendered from the old text. The greeting and the MOTD are
+ * kept pointing at the current text.
+ */
+void set_help_text(HELP_DATA *pHelp, char *text)
+{
+  pHelp->text = text;
+  template_clear(&pHelp->tpl);
+
+  if (!strcasecmp("GREETING", pHelp->keyword))
+  {
+    greeting = text;
+    template_clear(&greeting_tpl);
+  }
+  else if (!strcasecmp("MOTD", pHelp->keyword))
+  {
+    motd = text;
+    template_clear(&motd_tpl);
+  }
+}
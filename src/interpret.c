@@ -46,11 +46,14 @@ const struct typCmd tabCmd [] =
   { "commands",      cmd_commands,   LEVEL_GUEST  },
   { "compress",      cmd_compress,   LEVEL_GUEST  },
   { "copyover",      cmd_copyover,   LEVEL_GOD    },
+  { "events",        cmd_events,     LEVEL_ADMIN  },
   { "help",          cmd_help,       LEVEL_GUEST  },
   { "linkdead",      cmd_linkdead,   LEVEL_ADMIN  },
+  { "mccp",          cmd_mccp,       LEVEL_ADMIN  },
   { "say",           cmd_say,        LEVEL_GUEST  },
   { "save",          cmd_save,       LEVEL_GUEST  },
   { "shutdown",      cmd_shutdown,   LEVEL_GOD    },
+  { "sockets",       cmd_sockets,    LEVEL_ADMIN  },
   { "quit",          cmd_quit,       LEVEL_GUEST  },
   { "who",           cmd_who,        LEVEL_GUEST  },
 
@@ -15,6 +15,7 @@
 
 extern FILE *stderr;
 time_t current_time;
+long long current_mono;
 
 /*
  * Nifty little extendable logfunction,
@@ -27,14 +28,22 @@ void log_string(const char *txt, ...)
   FILE *fp;
   char logfile[MAX_BUFFER];
   char buf[MAX_BUFFER];
-  char *strtime = get_time();
+  char *strtime;
   va_list args;
 
   va_start(args, txt);
   vsnprintf(buf, MAX_BUFFER, txt, args);
   va_end(args);
 
+  /* network threads leave the logging to the game */
+  if (!is_game_thread())
+  {
+    net_post_game(NULL, NET_MSG_LOG, buf, strlen(buf));
+    return;
+  }
+
   /* point to the correct logfile */
+  strtime = get_time();
   snprintf(logfile, MAX_BUFFER, "../log/%6.6s.log", strtime);
 
   /* try to open logfile */
@@ -61,12 +70,20 @@ void bug(const char *txt, ...)
   FILE *fp;
   char buf[MAX_BUFFER];
   va_list args;
-  char *strtime = get_time();
+  char *strtime;
 
   va_start(args, txt);
   vsnprintf(buf, MAX_BUFFER, txt, args);
   va_end(args);
 
+  /* network threads leave the logging to the game */
+  if (!is_game_thread())
+  {
+    net_post_game(NULL, NET_MSG_BUG, buf, strlen(buf));
+    return;
+  }
+  strtime = get_time();
+
   /* try to open logfile */
   if ((fp = fopen("../log/bugs.txt", "a")) == NULL)
   {
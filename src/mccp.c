@@ -14,27 +14,169 @@
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <time.h>
+#include <pthread.h>
 
 #include "mud.h"
 
-/* local functions */
-bool  processCompressed       ( D_SOCKET *dsock );
-
 const unsigned char enable_compress  [] = { IAC, SB, TELOPT_COMPRESS, WILL, SE, 0 };
 const unsigned char enable_compress2 [] = { IAC, SB, TELOPT_COMPRESS2, IAC, SE, 0 };
 
+/* the level new output is compressed at, and how each level has done */
+int         mccp_level = MCCP_LEVEL_MAX;
+bool        mccp_auto  = TRUE;
+int         mccp_busy  = 0;
+MCCP_STATS  mccp_stats[MCCP_LEVEL_MAX + 1];
+
+/* a compression worker, each socket's stream is pinned to one of them */
+struct mccp_worker
+{
+  NET_QUEUE       inbox;        /* compression jobs from the sockets   */
+  pthread_mutex_t lock;         /* held while using the inbox          */
+  pthread_cond_t  wake;         /* signaled for every job              */
+  unsigned char * buf;          /* the compressed output is made here  */
+  int             size;
+};
+
+MCCP_WORKER *mccp_workers = NULL;
+int          mccp_worker_next = 0;
+int          mccp_inflight = 0;   /* jobs not handed back yet           */
+
+/* a block from zlib_alloc(), the memory zlib gets follows it */
+typedef union zslab_block ZSLAB_BLOCK;
+union zslab_block
+{
+  ZSLAB_BLOCK   * next;         /* the next free block of this size    */
+  int             slab;         /* the size class it belongs to        */
+  long double     align;        /* keeps what follows aligned          */
+};
+
+/* a size class, with the free blocks of that size */
+struct zslab
+{
+  size_t          size;
+  ZSLAB_BLOCK   * free;
+  int             count;
+};
+
+struct zslab     zslabs[ZSLAB_CLASSES];
+z_stream       * zpool[MCCP_POOL_MAX];   /* streams ready to be reset    */
+int              zpool_count = 0;
+pthread_mutex_t  zslab_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* local procedures */
+z_stream *get_stream            ( int level );
+void      release_stream        ( z_stream *s );
+void     *mccp_worker_loop      ( void *arg );
+void      mccp_work             ( MCCP_WORKER *worker, NET_MSG *msg );
+
 /*
  * Memory management - zlib uses these hooks to allocate and free memory
- * it needs
+ * it needs. Every stream asks for the same few sizes, so freed blocks are
+ * kept on a free list for each size, and handed out again from there.
+ * Like zlib's own allocator, we do not clear the memory.
  */
 void *zlib_alloc(void *opaque, unsigned int items, unsigned int size)
 {
-  return calloc(items, size);
+  ZSLAB_BLOCK *block;
+  size_t bytes = (size_t) items * size;
+  int i;
+
+  pthread_mutex_lock(&zslab_lock);
+  for (i = 0; i < ZSLAB_CLASSES && zslabs[i].size != 0 && zslabs[i].size != bytes; i++)
+    ;
+
+  /* a size we have not seen, take a free class for it */
+  if (i < ZSLAB_CLASSES && zslabs[i].size == 0)
+    zslabs[i].size = bytes;
+
+  if (i < ZSLAB_CLASSES && (block = zslabs[i].free) != NULL)
+  {
+    zslabs[i].free = block->next;
+    zslabs[i].count--;
+    pthread_mutex_unlock(&zslab_lock);
+  }
+  else
+  {
+    pthread_mutex_unlock(&zslab_lock);
+    if ((block = malloc(sizeof(*block) + bytes)) == NULL)
+      return NULL;
+  }
+
+  block->slab = i;
+  return block + 1;
 }
 
 void zlib_free(void *opaque, void *address)
 {
-  free(address);
+  ZSLAB_BLOCK *block = (ZSLAB_BLOCK *) address - 1;
+  int i = block->slab;
+
+  pthread_mutex_lock(&zslab_lock);
+  if (i < ZSLAB_CLASSES && zslabs[i].count < ZSLAB_MAX)
+  {
+    block->next = zslabs[i].free;
+    zslabs[i].free = block;
+    zslabs[i].count++;
+    pthread_mutex_unlock(&zslab_lock);
+    return;
+  }
+  pthread_mutex_unlock(&zslab_lock);
+
+  free(block);
+}
+
+/*
+ * Get a stream ready to compress at `level'. Streams which have been
+ * used before are reset and used again, since setting up a new one
+ * means allocating the window and hash tables all over.
+ */
+z_stream *get_stream(int level)
+{
+  z_stream *s = NULL;
+
+  pthread_mutex_lock(&zslab_lock);
+  if (zpool_count > 0)
+    s = zpool[--zpool_count];
+  pthread_mutex_unlock(&zslab_lock);
+
+  if (s != NULL)
+  {
+    deflateReset(s);
+    deflateParams(s, level, Z_DEFAULT_STRATEGY);
+    return s;
+  }
+
+  if ((s = (z_stream *) malloc(sizeof(*s))) == NULL)
+    return NULL;
+
+  s->zalloc = zlib_alloc;
+  s->zfree  = zlib_free;
+  s->opaque = NULL;
+
+  if (deflateInit2(s, level, Z_DEFLATED, MCCP_WINDOW_BITS, MCCP_MEM_LEVEL, Z_DEFAULT_STRATEGY) != Z_OK)
+  {
+    free(s);
+    return NULL;
+  }
+
+  return s;
+}
+
+/* Put a stream we are done with in the pool, any thread may do this */
+void release_stream(z_stream *s)
+{
+  pthread_mutex_lock(&zslab_lock);
+  if (zpool_count < MCCP_POOL_MAX)
+  {
+    zpool[zpool_count++] = s;
+    pthread_mutex_unlock(&zslab_lock);
+    return;
+  }
+  pthread_mutex_unlock(&zslab_lock);
+
+  deflateEnd(s);
+  free(s);
 }
 
 /*
@@ -43,46 +185,49 @@ void zlib_free(void *opaque, void *address)
 bool compressStart(D_SOCKET *dsock, unsigned char teleopt)
 {
   z_stream *s;
+  int level;
 
   /* already compressing */
   if (dsock->out_compress)
     return TRUE;
 
-  /* allocate and init stream, buffer */
-  s = (z_stream *) malloc(sizeof(*s));
-  dsock->out_compress_buf = (unsigned char *) malloc(COMPRESS_BUF_SIZE);
+  /* a worker may still be finishing an old stream, and look at this */
+  level = __atomic_load_n(&mccp_level, __ATOMIC_RELAXED);
+  __atomic_store_n(&dsock->compress_level, level, __ATOMIC_RELAXED);
+
+  if ((s = get_stream(level)) == NULL)
+    return FALSE;
+
+  /* the stream stays with one worker, so its output stays in order */
+  if (mccp_workers && !dsock->zworker)
+    dsock->zworker = &mccp_workers[__atomic_fetch_add(&mccp_worker_next, 1, __ATOMIC_RELAXED) % MCCP_THREADS];
+
+  /* the workers have their own buffers */
+  if (!mccp_workers)
+    dsock->out_compress_buf = (unsigned char *) malloc(COMPRESS_BUF_SIZE);
 
   s->next_in    =  NULL;
   s->avail_in   =  0;
   s->next_out   =  dsock->out_compress_buf;
   s->avail_out  =  COMPRESS_BUF_SIZE;
-  s->zalloc     =  zlib_alloc;
-  s->zfree      =  zlib_free;
-  s->opaque     =  NULL;
-
-  if (deflateInit(s, 9) != Z_OK)
-  {
-    free(dsock->out_compress_buf);
-    free(s);
-    return FALSE;
-  }
 
   /* version 1 or 2 support */
   if (teleopt == TELOPT_COMPRESS)
-    text_to_socket(dsock, (char *) enable_compress);
+    write_to_socket(dsock, (char *) enable_compress, strlen((char *) enable_compress));
   else if (teleopt == TELOPT_COMPRESS2)
-    text_to_socket(dsock, (char *) enable_compress2);
+    write_to_socket(dsock, (char *) enable_compress2, strlen((char *) enable_compress2));
   else
   {
     bug("Bad teleoption %d passed", teleopt);
     free(dsock->out_compress_buf);
-    free(s);
+    dsock->out_compress_buf = NULL;
+    release_stream(s);
     return FALSE;
   }
 
-  /* now we're compressing */
-  dsock->compressing = teleopt;
+  /* now we're compressing, the game may peek at compressing */
   dsock->out_compress = s;
+  __atomic_store_n(&dsock->compressing, teleopt, __ATOMIC_RELEASE);
 
   /* success */
   return TRUE;
@@ -99,9 +244,21 @@ bool compressEnd(D_SOCKET *dsock, unsigned char teleopt, bool forced)
   if (dsock->compressing != teleopt)
     return FALSE;
 
+  /* the worker ends the stream, once it is done with what it has */
+  if (mccp_workers)
+  {
+    NET_MSG *msg = alloc_net_msg(dsock, NET_MSG_FINISH, NULL, 0);
+
+    mccp_post(dsock, msg);
+    free(dsock->out_compress_buf);
+    __atomic_store_n(&dsock->compressing, 0, __ATOMIC_RELEASE);
+    dsock->out_compress     = NULL;
+    dsock->out_compress_buf = NULL;
+    return TRUE;
+  }
+
   dsock->out_compress->avail_in = 0;
   dsock->out_compress->next_in = dummy;
-  dsock->top_output = 0;
 
   /* No terminating signature is needed - receiver will get Z_STREAM_END */
   if (deflate(dsock->out_compress, Z_FINISH) != Z_STREAM_END && !forced)
@@ -112,10 +269,9 @@ bool compressEnd(D_SOCKET *dsock, unsigned char teleopt, bool forced)
     return FALSE;
 
   /* reset compression values */
-  deflateEnd(dsock->out_compress);
+  release_stream(dsock->out_compress);
   free(dsock->out_compress_buf);
-  free(dsock->out_compress);
-  dsock->compressing      = 0;
+  __atomic_store_n(&dsock->compressing, 0, __ATOMIC_RELEASE);
   dsock->out_compress     = NULL;
   dsock->out_compress_buf = NULL;
 
@@ -123,10 +279,10 @@ bool compressEnd(D_SOCKET *dsock, unsigned char teleopt, bool forced)
   return TRUE;
 }
 
-/* Try to send any pending compressed-but-not-sent data in `desc' */
+/* Queue any pending compressed-but-not-sent data in `desc' */
 bool processCompressed(D_SOCKET *dsock)
 {
-  int iStart, nBlock, nWrite, len;
+  int len;
 
   if (!dsock->out_compress)
     return TRUE;
@@ -134,30 +290,256 @@ bool processCompressed(D_SOCKET *dsock)
   len = dsock->out_compress->next_out - dsock->out_compress_buf;
   if (len > 0)
   {
-    for (iStart = 0; iStart < len; iStart += nWrite)
+    net_write(dsock, (char *) dsock->out_compress_buf, len);
+    dsock->out_compress->next_out = dsock->out_compress_buf;
+  }
+
+  /* success */
+  return TRUE;
+}
+
+/*
+ * Move the stream on `desc' to the level the server wants. This is done
+ * before each write, when everything before has been flushed already.
+ */
+void compressLevel(D_SOCKET *dsock)
+{
+  z_stream *s = dsock->out_compress;
+  int level = __atomic_load_n(&mccp_level, __ATOMIC_RELAXED);
+
+  if (!s || level == dsock->compress_level)
+    return;
+
+  /* zlib may flush a little first, if it cannot we try again next time */
+  s->avail_out = COMPRESS_BUF_SIZE - (s->next_out - dsock->out_compress_buf);
+  if (deflateParams(s, level, Z_DEFAULT_STRATEGY) == Z_OK)
+    dsock->compress_level = level;
+}
+
+/* Count what a write at `level' did, any thread may do this */
+void compressAccount(int level, int bytes_in, int bytes_out, long long nsecs)
+{
+  __atomic_add_fetch(&mccp_stats[level].bytes_in, bytes_in, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&mccp_stats[level].bytes_out, bytes_out, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&mccp_stats[level].nsecs, nsecs, __ATOMIC_RELAXED);
+}
+
+/*
+ * Called by the game at the end of each pass. Once every MCCP_ADJUST_NSECS
+ * we see how much of that time the game was busy, and step the level down
+ * if the game is close to not keeping up, or back up if it is idle.
+ */
+void mccp_adjust(long long pass_start)
+{
+  static long long busy = 0, since = 0;
+  struct timespec now;
+  long long nsecs;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  nsecs = (long long) now.tv_sec * 1000000000LL + now.tv_nsec;
+  busy += nsecs - pass_start;
+
+  if (since == 0)
+    since = pass_start;
+  if (nsecs - since < MCCP_ADJUST_NSECS)
+    return;
+
+  mccp_busy = busy * 100 / (nsecs - since);
+  busy = 0;
+  since = nsecs;
+
+  if (!mccp_auto)
+    return;
+
+  if (mccp_busy >= MCCP_BUSY_HIGH && mccp_level > MCCP_LEVEL_MIN)
+  {
+    __atomic_store_n(&mccp_level, mccp_level - 1, __ATOMIC_RELAXED);
+    log_string("Mccp_adjust: game is %d%% busy, compressing at level %d.", mccp_busy, mccp_level);
+  }
+  else if (mccp_busy <= MCCP_BUSY_LOW && mccp_level < MCCP_LEVEL_MAX)
+  {
+    __atomic_store_n(&mccp_level, mccp_level + 1, __ATOMIC_RELAXED);
+  }
+}
+
+/*
+ * Start the compression workers. They live for as long as the program
+ * does, and simply die on a copyover, after net_stop() has made sure
+ * they have handed back all their work.
+ */
+void init_mccp()
+{
+  pthread_attr_t attr;
+  pthread_t thread;
+  int i;
+
+  if (MCCP_THREADS <= 0)
+    return;
+
+  if ((mccp_workers = calloc(MCCP_THREADS, sizeof(*mccp_workers))) == NULL)
+  {
+    bug("Init_mccp: Cannot allocate memory.");
+    abort();
+  }
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+  for (i = 0; i < MCCP_THREADS; i++)
+  {
+    net_queue_init(&mccp_workers[i].inbox);
+    pthread_mutex_init(&mccp_workers[i].lock, NULL);
+    pthread_cond_init(&mccp_workers[i].wake, NULL);
+
+    if (pthread_create(&thread, &attr, &mccp_worker_loop, (void *) &mccp_workers[i]) != 0)
     {
-      nBlock = UMIN (len - iStart, 4096);
-      if ((nWrite = write(dsock->control, dsock->out_compress_buf + iStart, nBlock)) < 0)
-      {
-        if (errno == EAGAIN || errno == ENOSR)
-          break;
+      bug("Init_mccp: Cannot start compression worker.");
+      abort();
+    }
+  }
+
+  pthread_attr_destroy(&attr);
+}
+
+/*
+ * Should output for `desc' go through its worker? Everything does while
+ * we compress, and while the worker has anything left for us, so
+ * nothing can overtake what the worker is doing.
+ */
+bool mccp_offload(D_SOCKET *dsock)
+{
+  return (dsock->zworker && (dsock->out_compress || dsock->zpending > 0));
+}
+
+/*
+ * Hand a job for `desc' to its worker, which takes over the message. It
+ * is compressed with the current stream, or passed back as it is if we
+ * are not compressing. Only the network thread owning `desc' may do this.
+ */
+void mccp_post(D_SOCKET *dsock, NET_MSG *msg)
+{
+  MCCP_WORKER *worker = dsock->zworker;
+
+  if (msg->type != NET_MSG_FINISH)
+    msg->type = NET_MSG_DEFLATE;
+  msg->stream = dsock->out_compress;
+
+  dsock->zpending++;
+  __atomic_add_fetch(&mccp_inflight, 1, __ATOMIC_RELAXED);
+
+  /* pushing under the lock, the worker never sees a half-done push */
+  pthread_mutex_lock(&worker->lock);
+  net_queue_push(&worker->inbox, msg);
+  pthread_cond_signal(&worker->wake);
+  pthread_mutex_unlock(&worker->lock);
+}
+
+/* A job for `desc' has been handed back */
+void mccp_done(D_SOCKET *dsock)
+{
+  dsock->zpending--;
+  __atomic_sub_fetch(&mccp_inflight, 1, __ATOMIC_RELAXED);
+}
+
+/* How many jobs the workers have not handed back yet */
+int mccp_pending()
+{
+  return __atomic_load_n(&mccp_inflight, __ATOMIC_RELAXED);
+}
+
+void *mccp_worker_loop(void *arg)
+{
+  MCCP_WORKER *worker = (MCCP_WORKER *) arg;
+  NET_MSG *msg;
+
+  worker->size = COMPRESS_BUF_SIZE;
+  if ((worker->buf = malloc(worker->size)) == NULL)
+  {
+    perror("Mccp_worker_loop");
+    abort();
+  }
+
+  for (;;)
+  {
+    /* sleep untill a socket hands us a job */
+    pthread_mutex_lock(&worker->lock);
+    while ((msg = net_queue_pop(&worker->inbox)) == NULL)
+      pthread_cond_wait(&worker->wake, &worker->lock);
+    pthread_mutex_unlock(&worker->lock);
+
+    mccp_work(worker, msg);
+  }
+
+  return NULL;
+}
+
+/*
+ * Do one job, and hand the result back to the network thread
+ * owning the socket, ready to be written.
+ */
+void mccp_work(MCCP_WORKER *worker, NET_MSG *msg)
+{
+  D_SOCKET *dsock = msg->dsock;
+  z_stream *s = msg->stream;
+  struct timespec start, end;
+  NET_MSG *result;
+  int level, status, flush, used = 0;
+
+  /* not compressing, it just had to wait its turn */
+  if (s == NULL)
+  {
+    net_post_write(dsock, msg);
+    return;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  flush = (msg->type == NET_MSG_FINISH) ? Z_FINISH : Z_SYNC_FLUSH;
+
+  /* follow the server's compression level */
+  level = __atomic_load_n(&mccp_level, __ATOMIC_RELAXED);
+  if (flush == Z_SYNC_FLUSH && level != __atomic_load_n(&dsock->compress_level, __ATOMIC_RELAXED))
+  {
+    s->avail_in  = 0;
+    s->next_out  = worker->buf;
+    s->avail_out = worker->size;
+    if (deflateParams(s, level, Z_DEFAULT_STRATEGY) == Z_OK)
+      __atomic_store_n(&dsock->compress_level, level, __ATOMIC_RELAXED);
+    used = worker->size - s->avail_out;
+  }
+
+  s->next_in  = (unsigned char *) msg->data;
+  s->avail_in = msg->length;
 
-        /* write error */
-        return FALSE;
+  do
+  {
+    /* make room if the buffer is full */
+    if (used == worker->size)
+    {
+      worker->size *= 2;
+      if ((worker->buf = realloc(worker->buf, worker->size)) == NULL)
+      {
+        perror("Mccp_work");
+        abort();
       }
-      if (nWrite <= 0)
-        break;
     }
 
-    if (iStart)
-    {
-      if (iStart < len)
-        memmove(dsock->out_compress_buf, dsock->out_compress_buf+iStart, len - iStart);
+    s->next_out  = worker->buf + used;
+    s->avail_out = worker->size - used;
+    status = deflate(s, flush);
+    used = worker->size - s->avail_out;
+  } while (status == Z_OK && (s->avail_in > 0 || s->avail_out == 0));
 
-      dsock->out_compress->next_out = dsock->out_compress_buf + len - iStart;
-    }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  if (flush == Z_FINISH)
+    release_stream(s);
+  else
+  {
+    compressAccount(__atomic_load_n(&dsock->compress_level, __ATOMIC_RELAXED), msg->length, used,
+      (end.tv_sec - start.tv_sec) * 1000000000LL + (end.tv_nsec - start.tv_nsec));
   }
 
-  /* success */
-  return TRUE;
+  result = alloc_net_msg(dsock, NET_MSG_WRITE, (char *) worker->buf, used);
+  free_net_msg(msg);
+  net_post_write(dsock, result);
 }
@@ -7,6 +7,9 @@
 
 #include <zlib.h>
 #include <pthread.h>
+#include <time.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
 #include <arpa/telnet.h>
 
 #include "list.h"
@@ -30,12 +33,40 @@
 /* A few globals */
 #define PULSES_PER_SECOND     4                   /* must divide 1000 : 4, 5 or 8 works */
 #define MAX_BUFFER         1024                   /* seems like a decent amount         */
-#define MAX_OUTPUT         2048                   /* well shoot me if it isn't enough   */
+#define MAX_INBUF          1024                   /* the longest line we will read      */
+#define MAX_OUTPUT        32768                   /* default for -maxoutput             */
+#define OUTPUT_CHUNK       1024                   /* the output queue grows this much   */
+#define SEGMENT_COPY_MAX    128                   /* shorter segments are copied        */
+#define MAX_SEND_QUEUE   262144                   /* net output before we hold back     */
 #define MAX_HELP_ENTRY     4096                   /* roughly 40 lines of blocktext      */
 #define MUDPORT            9009                   /* just set whatever port you want    */
+#define LISTEN_BACKLOG      128                   /* connections waiting to be accepted */
 #define FILE_TERMINATOR    "EOF"                  /* end of file marker                 */
 #define COPYOVER_FILE      "../txt/copyover.dat"  /* tempfile to store copyover data    */
 #define EXE_FILE           "../src/SocketMud"     /* the name of the mud binary         */
+#define MAX_INPUT_BACKLOG   256                   /* unhandled commands before overflow */
+#define PASSES_PER_SECOND    50                   /* how often we handle input/output   */
+#define CMDS_PER_PASS         8                   /* commands a socket may use a pass   */
+#define CMD_PASS_USECS    10000                   /* cpu time for commands each pass    */
+
+/* What the game loop does after a laghole */
+#define PULSE_SKIP             0  /* drop the pulses we missed           */
+#define PULSE_COMPRESS         1  /* run up to CATCHUP_PULSES of them    */
+#define PULSE_REPLAY           2  /* run every pulse we missed           */
+#define PULSE_CATCHUP          PULSE_SKIP
+#define CATCHUP_PULSES         4
+#define PULSE_NSECS            (1000000000LL / PULSES_PER_SECOND)
+
+/* Telnet parser states */
+#define TELNET_DATA            0  /* plain text                         */
+#define TELNET_IAC             1  /* got IAC                            */
+#define TELNET_OPT             2  /* got IAC WILL/WONT/DO/DONT          */
+#define TELNET_SB              3  /* got IAC SB, the option is next     */
+#define TELNET_SB_DATA         4  /* inside a subnegotiation            */
+#define TELNET_SB_IAC          5  /* got IAC inside a subnegotiation    */
+#define TELNET_CR              6  /* a line just ended with CR          */
+#define TELNET_LF              7  /* a line just ended with LF          */
+#define TELNET_SB_MAX         64  /* the most subnegotiation data kept  */
 
 /* Connection states */
 #define STATE_NEW_NAME         0
@@ -75,6 +106,7 @@ typedef  short int         sh_int;
  ***********************/
 
 #define UMIN(a, b)		((a) < (b) ? (a) : (b))
+#define UMAX(a, b)		((a) > (b) ? (a) : (b))
 #define IS_ADMIN(dMob)          ((dMob->level) > LEVEL_PLAYER ? TRUE : FALSE)
 #define IREAD(sKey, sPtr)             \
 {                                     \
@@ -108,48 +140,101 @@ typedef  short int         sh_int;
 typedef struct  dSocket       D_SOCKET;
 typedef struct  dMobile       D_MOBILE;
 typedef struct  help_data     HELP_DATA;
-typedef struct  lookup_data   LOOKUP_DATA;
 typedef struct  event_data    EVENT_DATA;
+typedef struct  out_chunk     OUT_CHUNK;
+typedef struct  template      TEMPLATE;
+typedef struct  segment       SEGMENT;
+typedef struct  reactor_data  REACTOR;
+typedef struct  uring_data    URING;
+typedef struct  net_msg       NET_MSG;
+typedef struct  net_queue     NET_QUEUE;
+typedef struct  net_thread    NET_THREAD;
+typedef struct  dns_request   DNS_REQUEST;
+typedef struct  dns_entry     DNS_ENTRY;
+typedef struct  mccp_worker   MCCP_WORKER;
 
 /* the actual structures */
 struct dSocket
 {
   D_MOBILE      * player;
-  LIST          * events;
+  EVENT_DATA    * events;
   char          * hostname;
-  char            inbuf[MAX_BUFFER];
-  char            outbuf[MAX_OUTPUT];
+  char            inbuf[MAX_INBUF];            /* the line being read       */
+  int             in_len;                      /* the length of that line   */
+  unsigned char   telnet_state;                /* TELNET_XXX parser state   */
+  unsigned char   telnet_verb;                 /* WILL, WONT, DO or DONT    */
+  unsigned char   sb_option;                   /* the option being sub'ed   */
+  int             sb_len;                      /* bytes in sb_data          */
+  unsigned char   sb_data[TELNET_SB_MAX];      /* subnegotiation data       */
+  OUT_CHUNK     * out_first;                   /* the output queue          */
+  OUT_CHUNK     * out_last;
   char            next_command[MAX_BUFFER];
   bool            bust_prompt;
+  bool            out_overflow;                /* the output was cut short  */
   sh_int          lookup_status;
   sh_int          state;
   sh_int          control;
-  sh_int          top_output;
+  int             top_output;                  /* bytes in the output queue */
   unsigned char   compressing;                 /* MCCP support */
   z_stream      * out_compress;                /* MCCP support */
   unsigned char * out_compress_buf;            /* MCCP support */
+  int             compress_level;              /* MCCP support */
+  MCCP_WORKER   * zworker;                     /* compresses our output     */
+  int             zpending;                    /* work the worker still has */
+  bool            zclosing;                    /* close when it is done     */
+  NET_THREAD    * net;                         /* the thread doing our io   */
+  NET_MSG       * cmd_first;                   /* commands waiting for game */
+  NET_MSG       * cmd_last;
+  int             cmd_backlog;                 /* commands not handled yet  */
+  int             cmd_peak;                    /* the longest backlog seen  */
+  bool            hangup;                      /* net side is done with us  */
+  bool            released;                    /* ready to be recycled      */
+  NET_MSG       * send_first;                  /* output waiting for write  */
+  NET_MSG       * send_last;
+  int             send_off;                    /* bytes of send_first sent  */
+  D_SOCKET      * send_next;                   /* next socket with output   */
+  bool            send_dirty;                  /* we are on the send list   */
+  bool            send_armed;                  /* waiting for room to write */
+  int             send_depth;                  /* bytes the kernel lacks    */
 };
 
 struct dMobile
 {
   D_SOCKET      * socket;
-  LIST          * events;
+  EVENT_DATA    * events;
   char          * name;
   char          * password;
   sh_int          level;
 };
 
+struct template
+{
+  char          * data;     /* the rendered text, NULL if not rendered  */
+  int             len;
+};
+
 struct help_data
 {
   time_t          load_time;
   char          * keyword;
   char          * text;
+  TEMPLATE        tpl;      /* the rendered help entry                  */
 };
 
-struct lookup_data
+/* rendered text shared by many output queues, it is never changed */
+struct segment
 {
-  D_SOCKET       * dsock;   /* the socket we wish to do a hostlookup on */
-  char           * buf;     /* the buffer it should be stored in        */
+  int              refs;    /* how many holds it, changed atomically    */
+  int              length;
+  char           * data;
+};
+
+struct out_chunk
+{
+  OUT_CHUNK      * next;    /* the next chunk in the output queue       */
+  SEGMENT        * segment; /* if set, the chunk holds no data itself   */
+  int              len;     /* how much of data is used                 */
+  char             data[OUTPUT_CHUNK];
 };
 
 struct typCmd
@@ -168,6 +253,10 @@ typedef struct buffer_type
 
 /* here we include external structure headers */
 #include "event.h"
+#include "reactor.h"
+#include "net.h"
+#include "dns.h"
+#include "scan.h"
 
 /******************************
  * End of new structures      *
@@ -180,14 +269,23 @@ typedef struct buffer_type
 extern  STACK       *   dsock_free;       /* the socket free list               */
 extern  LIST        *   dsock_list;       /* the linked list of active sockets  */
 extern  STACK       *   dmobile_free;     /* the mobile free list               */
+extern  STACK       *   output_free;      /* the output chunk free list         */
+extern  STACK       *   link_free;        /* the segment chunk free list        */
 extern  LIST        *   dmobile_list;     /* the mobile list of active mobiles  */
 extern  LIST        *   help_list;        /* the linked list of help files      */
 extern  const struct    typCmd tabCmd[];  /* the command table                  */
 extern  bool            shut_down;        /* used for shutdown                  */
 extern  char        *   greeting;         /* the welcome greeting               */
 extern  char        *   motd;             /* the MOTD help file                 */
-extern  int             control;          /* boot control socket thingy         */
+extern  TEMPLATE        greeting_tpl;     /* the rendered greeting              */
+extern  TEMPLATE        motd_tpl;         /* the rendered MOTD                  */
+extern  int             listeners[];      /* the sockets we accept on           */
+extern  int             listener_count;   /* how many listeners there are       */
 extern  time_t          current_time;     /* let's cut down on calls to time()  */
+extern  long long       current_mono;     /* CLOCK_MONOTONIC in nanoseconds     */
+extern  const char      input_overflow[]; /* sent before we drop a flooder      */
+extern  const char      output_overflow[];/* sent where we cut the output       */
+extern  int             max_output;       /* output queued for one socket       */
 
 /*************************** 
  * End of Global Variables *
@@ -203,6 +301,30 @@ extern const unsigned char compress_will2[];
 #define TELOPT_COMPRESS       85
 #define TELOPT_COMPRESS2      86
 #define COMPRESS_BUF_SIZE   8192
+#define MCCP_LEVEL_MIN         1  /* the fastest level we step down to  */
+#define MCCP_LEVEL_MAX         9  /* the best level, used when idle     */
+#define MCCP_BUSY_HIGH        75  /* step down when the game is busier  */
+#define MCCP_BUSY_LOW         25  /* step up when the game is less busy */
+#define MCCP_ADJUST_NSECS     1000000000LL  /* how often we may step    */
+#define MCCP_THREADS           2  /* compression workers, 0 for none    */
+#define MCCP_WINDOW_BITS      12  /* deflate window, 8 to 15            */
+#define MCCP_MEM_LEVEL         5  /* deflate hash table size, 1 to 9    */
+#define MCCP_POOL_MAX         64  /* unused streams kept for reuse      */
+#define ZSLAB_CLASSES          8  /* allocation sizes zlib_alloc keeps  */
+#define ZSLAB_MAX             64  /* free blocks kept of each size      */
+
+/* how much each compression level has done */
+typedef struct mccp_stats
+{
+  long long       bytes_in;     /* text given to deflate            */
+  long long       bytes_out;    /* compressed bytes written         */
+  long long       nsecs;        /* time spent compressing           */
+} MCCP_STATS;
+
+extern int             mccp_level;      /* the level sockets should use     */
+extern bool            mccp_auto;       /* the level follows the load       */
+extern int             mccp_busy;       /* how busy the game was, percent   */
+extern MCCP_STATS      mccp_stats[];    /* indexed by level                 */
 
 /***********************
  * End of MCCP support *
@@ -224,19 +346,28 @@ char  *crypt                  ( const char *key, const char *salt );
 /*
  * socket.c
  */
-int   init_socket             ( void );
+int   init_socket             ( const char *spec );
 bool  new_socket              ( int sock );
 void  close_socket            ( D_S *dsock, bool reconnect );
 bool  read_from_socket        ( D_S *dsock );
 bool  text_to_socket          ( D_S *dsock, const char *txt );  /* sends the output directly */
+bool  write_to_socket         ( D_S *dsock, const char *txt, int length );
 void  text_to_buffer          ( D_S *dsock, const char *txt );  /* buffers the output        */
 void  text_to_mobile          ( D_M *dMob, const char *txt );   /* buffers the output        */
-void  next_cmd_from_buffer    ( D_S *dsock );
+bool  render_ansi             ( const char *txt, int length, bool (* out)(void *arg, const char *txt, int length), void *arg );
+bool  line_to_game            ( D_S *dsock );
+void  next_cmd_from_queue     ( D_S *dsock );
+bool  handle_cmd_queues       ( void );
+void  handle_net_messages     ( void );
 bool  flush_output            ( D_S *dsock );
+void  send_output             ( D_S *dsock );
+int   send_queue_depth        ( D_S *dsock );
+bool  output_to_buffer        ( D_S *dsock, const char *txt, int length );
+bool  link_to_buffer          ( D_S *dsock, SEGMENT *seg );
+void  free_output             ( D_S *dsock );
 void  handle_new_connections  ( D_S *dsock, char *arg );
 void  clear_socket            ( D_S *sock_new, int sock );
 void  recycle_sockets         ( void );
-void *lookup_address          ( void *arg );
 
 /*
  * interpret.c
@@ -284,6 +415,8 @@ void  free_mobile             ( D_M *dMob );
 void  communicate             ( D_M *dMob, char *txt, int range );
 void  load_muddata            ( bool fCopyOver );
 char *get_time                ( void );
+void  update_time             ( void );
+int   number_range            ( int from, int to );
 void  copyover_recover        ( void );
 D_M  *check_reconnect         ( char *player );
 
@@ -300,12 +433,41 @@ void  cmd_compress            ( D_M *dMob, char *arg );
 void  cmd_save                ( D_M *dMob, char *arg );
 void  cmd_copyover            ( D_M *dMob, char *arg );
 void  cmd_linkdead            ( D_M *dMob, char *arg );
+void  cmd_sockets             ( D_M *dMob, char *arg );
+void  cmd_events              ( D_M *dMob, char *arg );
+void  cmd_mccp                ( D_M *dMob, char *arg );
 
 /*
  * mccp.c
  */
 bool  compressStart           ( D_S *dsock, unsigned char teleopt );
 bool  compressEnd             ( D_S *dsock, unsigned char teleopt, bool forced );
+bool  processCompressed       ( D_S *dsock );
+void  compressLevel           ( D_S *dsock );
+void  compressAccount         ( int level, int bytes_in, int bytes_out, long long nsecs );
+void  mccp_adjust             ( long long pass_start );
+void  init_mccp               ( void );
+bool  mccp_offload            ( D_S *dsock );
+void  mccp_post               ( D_S *dsock, NET_MSG *msg );
+void  mccp_done               ( D_S *dsock );
+int   mccp_pending            ( void );
+
+/*
+ * telnet.c
+ */
+bool  telnet_parse            ( D_S *dsock, const char *data, int length );
+
+/*
+ * template.c
+ */
+void  template_compile        ( TEMPLATE *tpl, const char *txt );
+void  template_clear          ( TEMPLATE *tpl );
+void  template_to_buffer      ( D_S *dsock, TEMPLATE *tpl, const char *txt );
+void  template_to_mobile      ( D_M *dMob, TEMPLATE *tpl, const char *txt );
+SEGMENT *render_segment       ( const char *txt );
+void  free_segment            ( SEGMENT *seg );
+void  segment_to_buffer       ( D_S *dsock, SEGMENT *seg );
+void  segment_to_mobile       ( D_M *dMob, SEGMENT *seg );
 
 /*
  * save.c
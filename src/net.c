@@ -0,0 +1,779 @@
+/*
+ * This file contains the network threads. Each thread owns a
+ * reactor and the sockets attached to it, and does all reading,
+ * telnet parsing, compression and writing for those sockets.
+ * Complete command lines are passed on to the game thread, and
+ * the game passes rendered output back, all through lock-free
+ * queues, so the game itself stays single-threaded.
+ *
+ * With no network threads, the game thread does the io itself,
+ * passing the exact same messages.
+ */
+
+#include <sys/types.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+
+/* including main header file */
+#include "mud.h"
+
+/* local variables */
+NET_THREAD  ** net_threads = NULL;     /* all the network threads            */
+int            net_count = 0;          /* how many there are                 */
+int            net_next = 0;           /* the next thread to get a socket    */
+bool           net_threaded = FALSE;   /* do we run real threads             */
+NET_QUEUE      game_inbox;             /* messages for the game thread       */
+pthread_t      game_thread;            /* the thread running the game        */
+bool           game_woken = FALSE;     /* the game has been woken up         */
+
+/* local procedures */
+void      net_process_inbox     ( NET_THREAD *net );
+void      net_queue_output      ( D_SOCKET *dsock, NET_MSG *msg );
+bool      net_send              ( D_SOCKET *dsock );
+void      net_send_all          ( NET_THREAD *net );
+void      net_free_output       ( D_SOCKET *dsock );
+void      net_close             ( NET_THREAD *net, D_SOCKET *dsock );
+void     *net_thread_loop       ( void *arg );
+
+/*
+ * Net_queue_init()
+ *
+ * The queue always holds at least the stub, so producers
+ * never have to touch the consumer end of the queue.
+ */
+void net_queue_init(NET_QUEUE *queue)
+{
+  memset(&queue->stub, 0, sizeof(queue->stub));
+  queue->head = &queue->stub;
+  queue->tail = &queue->stub;
+}
+
+/*
+ * Net_queue_push()
+ *
+ * Adds a message to the queue. Any thread may do this.
+ */
+void net_queue_push(NET_QUEUE *queue, NET_MSG *msg)
+{
+  NET_MSG *prev;
+
+  __atomic_store_n(&msg->next, NULL, __ATOMIC_RELAXED);
+  prev = __atomic_exchange_n(&queue->head, msg, __ATOMIC_ACQ_REL);
+  __atomic_store_n(&prev->next, msg, __ATOMIC_RELEASE);
+}
+
+/*
+ * Net_queue_pop()
+ *
+ * Removes the oldest message from the queue. Only the thread
+ * owning the queue may do this. Returns NULL if the queue is
+ * empty, or if a producer is halfway through a push, in which
+ * case the message will be there on the next call.
+ */
+NET_MSG *net_queue_pop(NET_QUEUE *queue)
+{
+  NET_MSG *tail = queue->tail;
+  NET_MSG *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+  /* skip past the stub */
+  if (tail == &queue->stub)
+  {
+    if (next == NULL)
+      return NULL;
+
+    queue->tail = next;
+    tail = next;
+    next = __atomic_load_n(&next->next, __ATOMIC_ACQUIRE);
+  }
+
+  if (next != NULL)
+  {
+    queue->tail = next;
+    return tail;
+  }
+
+  /* a producer is pushing right now */
+  if (tail != __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE))
+    return NULL;
+
+  /* put the stub back, so we can hand out the last message */
+  net_queue_push(queue, &queue->stub);
+
+  if ((next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE)) != NULL)
+  {
+    queue->tail = next;
+    return tail;
+  }
+
+  return NULL;
+}
+
+/*
+ * Alloc_net_msg()
+ *
+ * Allocates a message, with a copy of the data.
+ */
+NET_MSG *alloc_net_msg(D_SOCKET *dsock, int type, const char *data, int length)
+{
+  NET_MSG *msg;
+
+  if ((msg = malloc(sizeof(*msg) + length + 1)) == NULL)
+  {
+    perror("Alloc_net_msg");
+    abort();
+  }
+
+  msg->next   = NULL;
+  msg->dsock  = dsock;
+  msg->type   = type;
+  msg->length = length;
+  msg->data   = (char *) (msg + 1);
+  msg->segment = NULL;
+  msg->stream  = NULL;
+
+  if (length > 0 && data != NULL)
+    memcpy(msg->data, data, length);
+  msg->data[length] = '\0';
+
+  return msg;
+}
+
+void free_net_msg(NET_MSG *msg)
+{
+  if (msg->segment)
+    free_segment(msg->segment);
+
+  free(msg);
+}
+
+/*
+ * Init_net()
+ *
+ * Sets up the network threads. This must be called after the
+ * game reactor has been created, since with no threads we
+ * simply use that reactor for all sockets.
+ */
+void init_net(int threads, int backend)
+{
+  NET_THREAD *net;
+  int i;
+
+  game_thread = pthread_self();
+  net_queue_init(&game_inbox);
+
+  net_threaded = (threads > 0);
+  net_count = net_threaded ? threads : 1;
+
+  if ((net_threads = calloc(net_count, sizeof(*net_threads))) == NULL)
+  {
+    bug("Init_net: Cannot allocate memory.");
+    abort();
+  }
+
+  for (i = 0; i < net_count; i++)
+  {
+    if ((net = calloc(1, sizeof(*net))) == NULL)
+    {
+      bug("Init_net: Cannot allocate memory.");
+      abort();
+    }
+
+    /* threads get a reactor of their own, without the listener */
+    net->reactor = net_threaded ? init_reactor(backend) : reactor;
+    net_queue_init(&net->inbox);
+    net_threads[i] = net;
+  }
+
+  if (net_threaded)
+    log_string("Init_net: using %d network threads.", net_count);
+
+  net_start();
+}
+
+/*
+ * Net_start()
+ *
+ * Starts the network threads, if we use any.
+ */
+void net_start()
+{
+  NET_THREAD *net;
+  int i;
+
+  if (!net_threaded)
+    return;
+
+  for (i = 0; i < net_count; i++)
+  {
+    net = net_threads[i];
+
+    if (net->running)
+      continue;
+
+    net->stopping = FALSE;
+    if (pthread_create(&net->thread, NULL, &net_thread_loop, (void *) net) != 0)
+    {
+      perror("Net_start: pthread_create");
+      exit(1);
+    }
+    net->running = TRUE;
+  }
+}
+
+/*
+ * Net_stop()
+ *
+ * Stops all network threads, once they have handled every
+ * message sent to them. Afterwards the game thread does all
+ * io itself, and everything posted is handled by net_kick().
+ * This also makes sure all output has been sent.
+ */
+void net_stop()
+{
+  NET_THREAD *net;
+  int i;
+
+  for (i = 0; i < net_count; i++)
+  {
+    net = net_threads[i];
+
+    if (!net->running)
+      continue;
+
+    net_queue_push(&net->inbox, alloc_net_msg(NULL, NET_MSG_STOP, NULL, 0));
+    reactor_wake(net->reactor);
+    pthread_join(net->thread, NULL);
+    net->running = FALSE;
+  }
+
+  /* keep going untill the compression workers have handed back everything */
+  for (;;)
+  {
+    for (i = 0; i < net_count; i++)
+    {
+      net = net_threads[i];
+
+      net_process_inbox(net);
+      reactor_flush(net->reactor);
+    }
+
+    if (mccp_pending() == 0)
+      break;
+    sched_yield();
+  }
+}
+
+/*
+ * Net_kick()
+ *
+ * Called by the game when it is done posting messages. Wakes
+ * up every thread with new messages, or handles the messages
+ * right away if there are no threads running.
+ */
+void net_kick()
+{
+  NET_THREAD *net;
+  int i;
+
+  for (i = 0; i < net_count; i++)
+  {
+    net = net_threads[i];
+
+    if (net->running)
+    {
+      if (net->pending)
+      {
+        net->pending = FALSE;
+        reactor_wake(net->reactor);
+      }
+      continue;
+    }
+
+    net_process_inbox(net);
+    reactor_submit(net->reactor);
+  }
+}
+
+/*
+ * Net_attach()
+ *
+ * Hands a new socket to one of the network threads.
+ */
+void net_attach(D_SOCKET *dsock)
+{
+  dsock->net = net_threads[net_next++ % net_count];
+  net_post(dsock, NET_MSG_ATTACH, NULL, 0);
+}
+
+/*
+ * Net_post()
+ *
+ * Sends a message from the game to the thread handling dsock.
+ */
+void net_post(D_SOCKET *dsock, int type, const char *data, int length)
+{
+  if (dsock->net == NULL)
+  {
+    bug("Net_post: socket %d has no network thread.", dsock->control);
+    return;
+  }
+
+  net_queue_push(&dsock->net->inbox, alloc_net_msg(dsock, type, data, length));
+  dsock->net->pending = TRUE;
+}
+
+/*
+ * Net_post_output()
+ *
+ * Sends a socket's queued output to its thread. The chunks
+ * between shared segments are gathered into one message,
+ * and each segment is sent as a message of its own, which
+ * refers to the segment instead of copying it.
+ */
+void net_post_output(D_SOCKET *dsock, OUT_CHUNK *chunk, int length)
+{
+  OUT_CHUNK *last;
+  NET_MSG *msg;
+  int size, copied;
+
+  if (dsock->net == NULL)
+  {
+    bug("Net_post_output: socket %d has no network thread.", dsock->control);
+    return;
+  }
+
+  /* count it as queued until the kernel has it */
+  __atomic_add_fetch(&dsock->send_depth, length, __ATOMIC_RELAXED);
+
+  while (chunk != NULL)
+  {
+    if (chunk->segment)
+    {
+      msg = alloc_net_msg(dsock, NET_MSG_OUTPUT, NULL, 0);
+      msg->segment = chunk->segment;
+      msg->data    = chunk->segment->data;
+      msg->length  = chunk->segment->length;
+      __atomic_add_fetch(&msg->segment->refs, 1, __ATOMIC_RELAXED);
+
+      net_queue_push(&dsock->net->inbox, msg);
+      chunk = chunk->next;
+      continue;
+    }
+
+    /* find the chunks up to the next segment */
+    for (size = 0, last = chunk; last != NULL && last->segment == NULL; last = last->next)
+      size += last->len;
+
+    msg = alloc_net_msg(dsock, NET_MSG_OUTPUT, NULL, size);
+    for (copied = 0; chunk != last; chunk = chunk->next)
+    {
+      memcpy(msg->data + copied, chunk->data, chunk->len);
+      copied += chunk->len;
+    }
+    msg->data[copied] = '\0';
+
+    net_queue_push(&dsock->net->inbox, msg);
+  }
+
+  dsock->net->pending = TRUE;
+}
+
+/*
+ * Net_post_write()
+ *
+ * Hands output which is ready to be written to the thread
+ * owning the socket, and wakes it up. The compression workers
+ * use this to pass back what they have compressed.
+ */
+void net_post_write(D_SOCKET *dsock, NET_MSG *msg)
+{
+  msg->type = NET_MSG_WRITE;
+  net_queue_push(&dsock->net->inbox, msg);
+  reactor_wake(dsock->net->reactor);
+}
+
+/*
+ * Net_post_game()
+ *
+ * Sends a message from a network thread to the game, and
+ * wakes the game up if nobody else has done so already.
+ */
+void net_post_game(D_SOCKET *dsock, int type, const char *data, int length)
+{
+  net_queue_push(&game_inbox, alloc_net_msg(dsock, type, data, length));
+
+  if (is_game_thread())
+    return;
+
+  if (!__atomic_exchange_n(&game_woken, TRUE, __ATOMIC_SEQ_CST))
+    reactor_wake(reactor);
+}
+
+/*
+ * Net_game_listen()
+ *
+ * Called by the game just before it takes its messages. Any
+ * message posted after this will wake the game up again.
+ */
+void net_game_listen()
+{
+  __atomic_store_n(&game_woken, FALSE, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Net_game_pop()
+ *
+ * Returns the next message for the game, or NULL.
+ */
+NET_MSG *net_game_pop()
+{
+  return net_queue_pop(&game_inbox);
+}
+
+/*
+ * Net_hangup()
+ *
+ * Called by the network side when a connection fails. We stop
+ * doing io on the socket, and ask the game to close it.
+ */
+void net_hangup(D_SOCKET *dsock)
+{
+  if (dsock->hangup)
+    return;
+
+  dsock->hangup = TRUE;
+
+  /* try to get a last message, like an overflow warning, out */
+  net_send(dsock);
+
+  reactor_del_socket(dsock->net->reactor, dsock);
+  net_post_game(dsock, NET_MSG_HANGUP, NULL, 0);
+}
+
+/*
+ * Net_write()
+ *
+ * Queues a copy of the data to be written to the socket
+ * when the thread is done handling messages and input.
+ */
+void net_write(D_SOCKET *dsock, const char *txt, int length)
+{
+  if (length <= 0)
+    return;
+
+  __atomic_add_fetch(&dsock->send_depth, length, __ATOMIC_RELAXED);
+  net_queue_output(dsock, alloc_net_msg(dsock, NET_MSG_OUTPUT, txt, length));
+}
+
+/*
+ * Net_queue_output()
+ *
+ * Adds a message to the socket's write queue, the socket
+ * takes over the message. The socket is put on the list
+ * of sockets to write to, if it isn't there already.
+ */
+void net_queue_output(D_SOCKET *dsock, NET_MSG *msg)
+{
+  msg->next = NULL;
+  if (dsock->send_last)
+    dsock->send_last->next = msg;
+  else
+    dsock->send_first = msg;
+  dsock->send_last = msg;
+
+  if (!dsock->send_dirty)
+  {
+    dsock->send_dirty = TRUE;
+    dsock->send_next = dsock->net->send_list;
+    dsock->net->send_list = dsock;
+  }
+}
+
+/*
+ * Net_send()
+ *
+ * Writes as much of the socket's write queue as the
+ * socket will take, using one writev() for up to
+ * NET_MAX_IOV queued messages. Anything the socket
+ * cannot take right now stays queued, and the reactor
+ * tells us when there is room again. Returns FALSE if
+ * the write fails.
+ */
+bool net_send(D_SOCKET *dsock)
+{
+  struct iovec iov[NET_MAX_IOV];
+  NET_MSG *msg;
+  int count, written;
+
+  while (dsock->send_first != NULL)
+  {
+    /* gather the queued messages */
+    for (count = 0, msg = dsock->send_first; msg != NULL && count < NET_MAX_IOV; msg = msg->next, count++)
+    {
+      iov[count].iov_base = msg->data;
+      iov[count].iov_len  = msg->length;
+    }
+    iov[0].iov_base = dsock->send_first->data + dsock->send_off;
+    iov[0].iov_len  = dsock->send_first->length - dsock->send_off;
+
+    if ((written = reactor_writev(dsock->net->reactor, dsock, iov, count)) < 0)
+    {
+      /* the socket is full, we try again when it has room */
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+      {
+        reactor_want_write(dsock->net->reactor, dsock, TRUE);
+        return TRUE;
+      }
+      if (errno == EINTR)
+        continue;
+
+      perror("Net_send");
+      return FALSE;
+    }
+
+    /* drop everything that has been written */
+    while (written > 0)
+    {
+      msg = dsock->send_first;
+
+      if (written < msg->length - dsock->send_off)
+      {
+        dsock->send_off += written;
+        break;
+      }
+
+      written -= msg->length - dsock->send_off;
+      dsock->send_off = 0;
+      if ((dsock->send_first = msg->next) == NULL)
+        dsock->send_last = NULL;
+      free_net_msg(msg);
+    }
+  }
+
+  reactor_want_write(dsock->net->reactor, dsock, FALSE);
+  return TRUE;
+}
+
+/*
+ * Net_writable()
+ *
+ * Called by the reactor when a socket which could not
+ * take all our output has room for more.
+ */
+void net_writable(D_SOCKET *dsock)
+{
+  if (dsock->hangup)
+    return;
+
+  if (!net_send(dsock))
+    net_hangup(dsock);
+}
+
+/*
+ * Net_send_all()
+ *
+ * Writes to every socket with queued output.
+ */
+void net_send_all(NET_THREAD *net)
+{
+  D_SOCKET *dsock, *dsock_next;
+
+  dsock = net->send_list;
+  net->send_list = NULL;
+
+  for ( ; dsock != NULL; dsock = dsock_next)
+  {
+    dsock_next = dsock->send_next;
+    dsock->send_dirty = FALSE;
+
+    if (dsock->hangup)
+      continue;
+
+    if (!net_send(dsock))
+      net_hangup(dsock);
+  }
+}
+
+/*
+ * Net_free_output()
+ *
+ * Throws away anything in the socket's write queue.
+ */
+void net_free_output(D_SOCKET *dsock)
+{
+  NET_MSG *msg;
+
+  while ((msg = dsock->send_first) != NULL)
+  {
+    dsock->send_first = msg->next;
+    free_net_msg(msg);
+  }
+
+  dsock->send_last = NULL;
+  dsock->send_off = 0;
+}
+
+/*
+ * Net_process_inbox()
+ *
+ * Handles every message the game has sent to this thread,
+ * then writes all the output queued while doing so, and
+ * while reading input.
+ */
+void net_process_inbox(NET_THREAD *net)
+{
+  NET_MSG *msg;
+  D_SOCKET *dsock;
+
+  while ((msg = net_queue_pop(&net->inbox)) != NULL)
+  {
+    dsock = msg->dsock;
+
+    switch(msg->type)
+    {
+      default:
+        bug("Net_process_inbox: bad message type %d.", msg->type);
+        break;
+      case NET_MSG_STOP:
+        net->stopping = TRUE;
+        break;
+      case NET_MSG_ATTACH:
+        if (!reactor_add_socket(net->reactor, dsock))
+          net_hangup(dsock);
+        break;
+      case NET_MSG_OUTPUT:
+        if (dsock->hangup)
+          break;
+
+        /* uncompressed output is written straight from the message */
+        if (dsock->out_compress == NULL && dsock->zpending == 0)
+        {
+          net_queue_output(dsock, msg);
+          continue;
+        }
+
+        /* the compression worker takes over the message */
+        if (mccp_offload(dsock))
+        {
+          __atomic_sub_fetch(&dsock->send_depth, msg->length, __ATOMIC_RELAXED);
+          mccp_post(dsock, msg);
+          continue;
+        }
+
+        /* the compressed output is counted instead */
+        if (!write_to_socket(dsock, msg->data, msg->length))
+          net_hangup(dsock);
+        __atomic_sub_fetch(&dsock->send_depth, msg->length, __ATOMIC_RELAXED);
+        break;
+      case NET_MSG_COMPRESS_END:
+        if (!dsock->hangup)
+          compressEnd(dsock, dsock->compressing, FALSE);
+        break;
+      case NET_MSG_CLOSE:
+        compressEnd(dsock, dsock->compressing, TRUE);
+
+        /* the compression worker still has work for us */
+        if (dsock->zpending > 0)
+        {
+          dsock->zclosing = TRUE;
+          break;
+        }
+        net_close(net, dsock);
+        break;
+      case NET_MSG_WRITE:
+        mccp_done(dsock);
+
+        if (!dsock->hangup && msg->length > 0)
+        {
+          __atomic_add_fetch(&dsock->send_depth, msg->length, __ATOMIC_RELAXED);
+          net_queue_output(dsock, msg);
+          msg = NULL;
+        }
+
+        if (dsock->zclosing && dsock->zpending == 0)
+          net_close(net, dsock);
+        break;
+    }
+
+    if (msg != NULL)
+      free_net_msg(msg);
+  }
+
+  net_send_all(net);
+}
+
+/*
+ * Net_close()
+ *
+ * Lets go of a socket the game has closed, writing what
+ * we can of its output first, and tells the game when the
+ * socket may be recycled.
+ */
+void net_close(NET_THREAD *net, D_SOCKET *dsock)
+{
+  D_SOCKET **prev;
+
+  /* write what we can, and forget the rest */
+  net_send_all(net);
+  net_free_output(dsock);
+  if (dsock->send_dirty)
+  {
+    for (prev = &net->send_list; *prev != dsock; prev = &(*prev)->send_next)
+      ;
+    *prev = dsock->send_next;
+    dsock->send_dirty = FALSE;
+  }
+
+  if (!dsock->hangup)
+  {
+    dsock->hangup = TRUE;
+    reactor_del_socket(net->reactor, dsock);
+  }
+  net_post_game(dsock, NET_MSG_CLOSED, NULL, 0);
+}
+
+/*
+ * Net_thread_loop()
+ *
+ * The main loop of a network thread. We sleep until there
+ * is io on one of our sockets, or until the game wakes us.
+ */
+void *net_thread_loop(void *arg)
+{
+  NET_THREAD *net = (NET_THREAD *) arg;
+
+  while (!net->stopping)
+  {
+    reactor_poll(net->reactor, -1);
+    net_process_inbox(net);
+    reactor_submit(net->reactor);
+  }
+
+  /* make sure everything has been sent before we leave */
+  reactor_flush(net->reactor);
+
+  return NULL;
+}
+
+/*
+ * Is_game_thread()
+ *
+ * Returns TRUE if we are running in the game thread.
+ */
+bool is_game_thread()
+{
+  if (net_count == 0)
+    return TRUE;
+
+  return pthread_equal(pthread_self(), game_thread) ? TRUE : FALSE;
+}
+
+int net_thread_count()
+{
+  return net_threaded ? net_count : 0;
+}
@@ -0,0 +1,84 @@
+/* net.h
+ *
+ * This file contains the network thread data structure, and the
+ * messages used to pass input and output between the network
+ * threads and the game. Only the game thread may touch the game,
+ * and only a socket's network thread may do io on that socket.
+ */
+
+/* the default number of network threads, -threads 0 does all io in the game thread */
+#define NET_THREADS              2
+
+/* the most pieces of output we hand to a single writev() */
+#define NET_MAX_IOV             64
+
+/* the different types of messages */
+#define NET_MSG_OUTPUT           0  /* game -> net : text to send       */
+#define NET_MSG_ATTACH           1  /* game -> net : start using socket */
+#define NET_MSG_CLOSE            2  /* game -> net : stop using socket  */
+#define NET_MSG_COMPRESS_END     3  /* game -> net : stop compressing   */
+#define NET_MSG_STOP             4  /* game -> net : the thread exits   */
+#define NET_MSG_WRITE            5  /* mccp -> net : ready to be written */
+#define NET_MSG_INPUT           10  /* net -> game : a command line     */
+#define NET_MSG_HANGUP          11  /* net -> game : connection failed  */
+#define NET_MSG_CLOSED          12  /* net -> game : socket released    */
+#define NET_MSG_LOG             13  /* net -> game : log this           */
+#define NET_MSG_BUG             14  /* net -> game : report this bug    */
+#define NET_MSG_RESOLVED        15  /* dns -> game : a hostname lookup  */
+#define NET_MSG_DEFLATE         20  /* net -> mccp : text to compress   */
+#define NET_MSG_FINISH          21  /* net -> mccp : end the stream     */
+
+/* a message, the data is stored right after the structure, or is a segment */
+struct net_msg
+{
+  NET_MSG          * next;             /* next message in the queue           */
+  D_SOCKET         * dsock;            /* the socket this message is about    */
+  sh_int             type;             /* NET_MSG_XXX                         */
+  int                length;           /* the length of the data              */
+  char             * data;             /* the data, always NUL terminated     */
+  SEGMENT          * segment;          /* if set, data is this shared segment */
+  z_stream         * stream;           /* the stream a compression job uses   */
+};
+
+/* a lock-free queue with any number of producers and one consumer */
+struct net_queue
+{
+  NET_MSG          * head;             /* the producers push here             */
+  NET_MSG          * tail;             /* the consumer pops here              */
+  NET_MSG            stub;             /* keeps the queue from being empty    */
+};
+
+/* a network thread, or the game thread doing io when run with -threads 0 */
+struct net_thread
+{
+  REACTOR          * reactor;          /* waits for io on our sockets         */
+  NET_QUEUE          inbox;            /* messages from the game              */
+  pthread_t          thread;           /* the thread itself                   */
+  bool               running;          /* the thread has been started         */
+  bool               stopping;         /* the thread has been asked to stop   */
+  bool               pending;          /* the game has posted new messages    */
+  D_SOCKET         * send_list;        /* sockets with output to write        */
+};
+
+/* functions which can be accessed outside net.c */
+void      init_net               ( int threads, int backend );
+void      net_start              ( void );
+void      net_stop               ( void );
+void      net_kick               ( void );
+void      net_attach             ( D_SOCKET *dsock );
+void      net_post               ( D_SOCKET *dsock, int type, const char *data, int length );
+void      net_post_output        ( D_SOCKET *dsock, OUT_CHUNK *chunk, int length );
+void      net_post_game          ( D_SOCKET *dsock, int type, const char *data, int length );
+NET_MSG  *net_game_pop           ( void );
+void      net_game_listen        ( void );
+void      net_hangup             ( D_SOCKET *dsock );
+void      net_write              ( D_SOCKET *dsock, const char *txt, int length );
+void      net_writable           ( D_SOCKET *dsock );
+void      net_post_write         ( D_SOCKET *dsock, NET_MSG *msg );
+void      net_queue_push         ( NET_QUEUE *queue, NET_MSG *msg );
+NET_MSG  *net_queue_pop          ( NET_QUEUE *queue );
+void      net_queue_init         ( NET_QUEUE *queue );
+NET_MSG  *alloc_net_msg          ( D_SOCKET *dsock, int type, const char *data, int length );
+void      free_net_msg           ( NET_MSG *msg );
+bool      is_game_thread         ( void );
+int       net_thread_count       ( void );
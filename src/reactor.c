@@ -0,0 +1,546 @@
+/*
+ * This file contains the reactor, which waits for activity
+ * on the listening sockets and all connected sockets using
+ * epoll, and dispatches the ready sockets to the socket code.
+ * If asked to at startup, the reactor will instead use the
+ * io_uring backend found in uring.c.
+ */
+
+/* for accept4() */
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <time.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+/* including main header file */
+#include "mud.h"
+
+/* the reactor used by the game loop */
+REACTOR *reactor = NULL;
+
+/* local procedures */
+bool  reactor_grow_table      ( REACTOR *pReactor, int fd );
+bool  reactor_is_listener     ( REACTOR *pReactor, int fd );
+void  reactor_accept          ( REACTOR *pReactor, int listener, int *budget );
+void  reactor_drain           ( REACTOR *pReactor, int timeout );
+
+/*
+ * Init_reactor()
+ *
+ * Creates the epoll descriptor, and the eventfd other
+ * threads use to wake us up. Listeners are added with
+ * reactor_add_listener().
+ *
+ * If the io_uring backend is requested, but the kernel
+ * does not support it, we fall back to using epoll.
+ */
+REACTOR *init_reactor(int backend)
+{
+  struct epoll_event ev;
+  REACTOR *pReactor;
+
+  if ((pReactor = malloc(sizeof(*pReactor))) == NULL)
+  {
+    bug("Init_reactor: Cannot allocate memory.");
+    abort();
+  }
+
+  pReactor->listener_count = 0;
+  pReactor->table_size = 0;
+  pReactor->table = NULL;
+  pReactor->poll_fd = -1;
+  pReactor->timer_fd = -1;
+  pReactor->uring = NULL;
+  pReactor->backend = REACTOR_EPOLL;
+  reactor_grow_table(pReactor, REACTOR_TABLE_SIZE - 1);
+
+  /* other threads use this to wake us up */
+  if ((pReactor->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+  {
+    perror("Init_reactor: eventfd");
+    exit(1);
+  }
+
+  if (backend == REACTOR_URING)
+  {
+    if ((pReactor->uring = init_uring(pReactor->wake_fd)) != NULL)
+    {
+      log_string("Init_reactor: using io_uring.");
+      pReactor->backend = REACTOR_URING;
+      return pReactor;
+    }
+    log_string("Init_reactor: io_uring is not available, using epoll.");
+  }
+
+  if ((pReactor->poll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+  {
+    perror("Init_reactor: epoll_create1");
+    exit(1);
+  }
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.fd = pReactor->wake_fd;
+  if (epoll_ctl(pReactor->poll_fd, EPOLL_CTL_ADD, pReactor->wake_fd, &ev) < 0)
+  {
+    perror("Init_reactor: epoll_ctl");
+    exit(1);
+  }
+
+  return pReactor;
+}
+
+/*
+ * Reactor_set_timer()
+ *
+ * Makes the reactor wake up at an absolute CLOCK_MONOTONIC
+ * deadline, even if there is no io. The timerfd is created
+ * the first time we need it, and waited on with the sockets.
+ */
+void reactor_set_timer(REACTOR *pReactor, const struct timespec *deadline)
+{
+  struct itimerspec spec;
+  struct epoll_event ev;
+
+  if (pReactor->timer_fd < 0)
+  {
+    if ((pReactor->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0)
+    {
+      perror("Reactor_set_timer: timerfd_create");
+      exit(1);
+    }
+
+    if (pReactor->backend == REACTOR_URING)
+      uring_add_timer(pReactor->uring, pReactor->timer_fd);
+    else
+    {
+      memset(&ev, 0, sizeof(ev));
+      ev.events = EPOLLIN;
+      ev.data.fd = pReactor->timer_fd;
+      if (epoll_ctl(pReactor->poll_fd, EPOLL_CTL_ADD, pReactor->timer_fd, &ev) < 0)
+      {
+        perror("Reactor_set_timer: epoll_ctl");
+        exit(1);
+      }
+    }
+  }
+
+  memset(&spec, 0, sizeof(spec));
+  spec.it_value = *deadline;
+  if (timerfd_settime(pReactor->timer_fd, TFD_TIMER_ABSTIME, &spec, NULL) < 0)
+    perror("Reactor_set_timer: timerfd_settime");
+}
+
+/*
+ * Reactor_add_listener()
+ *
+ * Starts accepting connections on a listening socket.
+ * Listeners are level-triggered, so connections we do
+ * not accept in one pass will be reported again on the
+ * next. Returns FALSE if we cannot use the listener.
+ */
+bool reactor_add_listener(REACTOR *pReactor, int listener)
+{
+  struct epoll_event ev;
+
+  if (pReactor->listener_count >= REACTOR_LISTENERS)
+  {
+    bug("Reactor_add_listener: more than %d listeners.", REACTOR_LISTENERS);
+    return FALSE;
+  }
+
+  if (pReactor->backend == REACTOR_URING)
+  {
+    if (!uring_add_listener(pReactor->uring, listener))
+      return FALSE;
+  }
+  else
+  {
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = listener;
+    if (epoll_ctl(pReactor->poll_fd, EPOLL_CTL_ADD, listener, &ev) < 0)
+    {
+      perror("Reactor_add_listener: epoll_ctl");
+      return FALSE;
+    }
+  }
+
+  pReactor->listeners[pReactor->listener_count++] = listener;
+
+  return TRUE;
+}
+
+/*
+ * Reactor_grow_table()
+ *
+ * Makes sure the descriptor table has room for fd.
+ */
+bool reactor_grow_table(REACTOR *pReactor, int fd)
+{
+  D_SOCKET **table;
+  int size;
+
+  if (fd < pReactor->table_size)
+    return TRUE;
+
+  size = (pReactor->table_size > 0) ? pReactor->table_size : REACTOR_TABLE_SIZE;
+  while (size <= fd)
+    size *= 2;
+
+  if ((table = realloc(pReactor->table, size * sizeof(*table))) == NULL)
+  {
+    bug("Reactor_grow_table: Cannot allocate memory for %d slots.", size);
+    return FALSE;
+  }
+
+  memset(table + pReactor->table_size, 0, (size - pReactor->table_size) * sizeof(*table));
+  pReactor->table = table;
+  pReactor->table_size = size;
+
+  return TRUE;
+}
+
+/*
+ * Reactor_add_socket()
+ *
+ * Starts watching a socket for input. Sockets are
+ * edge-triggered, so read_from_socket() must drain
+ * the socket every time it is called.
+ */
+bool reactor_add_socket(REACTOR *pReactor, D_SOCKET *dsock)
+{
+  struct epoll_event ev;
+
+  if (!reactor_grow_table(pReactor, dsock->control))
+    return FALSE;
+
+  if (pReactor->backend == REACTOR_URING)
+  {
+    if (!uring_add_socket(pReactor->uring, dsock))
+      return FALSE;
+
+    pReactor->table[dsock->control] = dsock;
+    return TRUE;
+  }
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+  ev.data.fd = dsock->control;
+  if (epoll_ctl(pReactor->poll_fd, EPOLL_CTL_ADD, dsock->control, &ev) < 0)
+  {
+    perror("Reactor_add_socket: epoll_ctl");
+    return FALSE;
+  }
+
+  pReactor->table[dsock->control] = dsock;
+
+  return TRUE;
+}
+
+/*
+ * Reactor_del_socket()
+ *
+ * Stops watching a socket. It is safe to call this
+ * for a socket which was never added.
+ */
+void reactor_del_socket(REACTOR *pReactor, D_SOCKET *dsock)
+{
+  if (reactor_lookup(pReactor, dsock->control) != dsock)
+    return;
+
+  if (pReactor->backend == REACTOR_URING)
+    uring_del_socket(pReactor->uring, dsock);
+  else
+    epoll_ctl(pReactor->poll_fd, EPOLL_CTL_DEL, dsock->control, NULL);
+
+  pReactor->table[dsock->control] = NULL;
+}
+
+/*
+ * Reactor_want_write()
+ *
+ * Asks to be told when the socket can take more output,
+ * or stops asking. io_uring keeps the data it could not
+ * send yet and retries on it's own, so there we do nothing.
+ */
+void reactor_want_write(REACTOR *pReactor, D_SOCKET *dsock, bool on)
+{
+  struct epoll_event ev;
+
+  if (pReactor->backend == REACTOR_URING || dsock->send_armed == on)
+    return;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET | (on ? EPOLLOUT : 0);
+  ev.data.fd = dsock->control;
+  if (epoll_ctl(pReactor->poll_fd, EPOLL_CTL_MOD, dsock->control, &ev) < 0)
+  {
+    perror("Reactor_want_write: epoll_ctl");
+    return;
+  }
+
+  dsock->send_armed = on;
+}
+
+/*
+ * Reactor_lookup()
+ *
+ * Returns the socket using the descriptor fd, or NULL.
+ */
+D_SOCKET *reactor_lookup(REACTOR *pReactor, int fd)
+{
+  if (fd < 0 || fd >= pReactor->table_size)
+    return NULL;
+
+  return pReactor->table[fd];
+}
+
+/*
+ * Reactor_is_listener()
+ *
+ * Returns TRUE if fd is one of our listeners.
+ */
+bool reactor_is_listener(REACTOR *pReactor, int fd)
+{
+  int i;
+
+  for (i = 0; i < pReactor->listener_count; i++)
+  {
+    if (pReactor->listeners[i] == fd)
+      return TRUE;
+  }
+
+  return FALSE;
+}
+
+/*
+ * Reactor_accept()
+ *
+ * Accepts pending connections from the listener, until
+ * it has no more or we have used up the budget for this
+ * call to reactor_poll().
+ * New sockets are non-blocking, and closed on exec, which
+ * copyover undoes for the sockets it keeps.
+ */
+void reactor_accept(REACTOR *pReactor, int listener, int *budget)
+{
+  int newConnection;
+
+  while (*budget > 0)
+  {
+    if ((newConnection = accept4(listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) < 0)
+    {
+      /* the client gave up before we got to it */
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        perror("Reactor_accept: accept4");
+      return;
+    }
+
+    (*budget)--;
+    new_socket(newConnection);
+  }
+}
+
+/*
+ * Reactor_poll()
+ *
+ * Waits up to timeout milliseconds for activity, then
+ * accepts new connections, reads from every socket that
+ * has input, and writes to every socket that can take the
+ * output it is holding. Sockets that fail are hung up.
+ */
+void reactor_poll(REACTOR *pReactor, int timeout)
+{
+  struct epoll_event events[REACTOR_EVENTS];
+  D_SOCKET *dsock;
+  int i, nEvents, budget = ACCEPT_BUDGET;
+
+  if (pReactor->backend == REACTOR_URING)
+  {
+    uring_poll(pReactor->uring, timeout);
+    return;
+  }
+
+  if ((nEvents = epoll_wait(pReactor->poll_fd, events, REACTOR_EVENTS, timeout)) < 0)
+  {
+    if (errno != EINTR)
+      perror("Reactor_poll: epoll_wait");
+    return;
+  }
+
+  for (i = 0; i < nEvents; i++)
+  {
+    if (reactor_is_listener(pReactor, events[i].data.fd))
+    {
+      reactor_accept(pReactor, events[i].data.fd, &budget);
+      continue;
+    }
+    if (events[i].data.fd == pReactor->wake_fd || events[i].data.fd == pReactor->timer_fd)
+    {
+      uint64_t count;
+
+      if (read(events[i].data.fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        perror("Reactor_poll: read");
+      continue;
+    }
+
+    /* the socket may have been hung up by an earlier event */
+    if ((dsock = reactor_lookup(pReactor, events[i].data.fd)) == NULL)
+      continue;
+    if (dsock->hangup)
+      continue;
+
+    /* hang up sockets we are unable to read from */
+    if ((events[i].events & ~EPOLLOUT) && !read_from_socket(dsock))
+    {
+      net_hangup(dsock);
+      continue;
+    }
+
+    /* the socket has room for more output */
+    if (events[i].events & EPOLLOUT)
+      net_writable(dsock);
+  }
+}
+
+/*
+ * Reactor_writev()
+ *
+ * Writes data gathered from several buffers to a socket.
+ * With epoll this is a plain writev(), while io_uring
+ * queues the data to be sent the next time the reactor
+ * is submitted. Returns the number of bytes written, or
+ * -1 on errors.
+ */
+int reactor_writev(REACTOR *pReactor, D_SOCKET *dsock, const struct iovec *iov, int count)
+{
+  int i, written, total = 0;
+
+  if (pReactor->backend == REACTOR_EPOLL)
+  {
+    if ((total = writev(dsock->control, iov, count)) > 0)
+      __atomic_sub_fetch(&dsock->send_depth, total, __ATOMIC_RELAXED);
+    return total;
+  }
+
+  /* like writev(), we stop when the ring takes only part of the data */
+  for (i = 0; i < count; i++)
+  {
+    if ((written = uring_write(pReactor->uring, dsock, iov[i].iov_base, iov[i].iov_len)) < 0)
+      return (total > 0) ? total : -1;
+
+    total += written;
+    if (written < (int) iov[i].iov_len)
+      break;
+  }
+
+  return total;
+}
+
+/*
+ * Reactor_submit()
+ *
+ * Hands all output queued during this pulse to the kernel.
+ * Does nothing with epoll, where every write is immediate.
+ */
+void reactor_submit(REACTOR *pReactor)
+{
+  if (pReactor->backend == REACTOR_URING)
+    uring_submit(pReactor->uring);
+}
+
+/*
+ * Reactor_flush()
+ *
+ * Makes sure all queued output has been sent, this is
+ * used before a copyover, when the reactor goes away.
+ */
+void reactor_flush(REACTOR *pReactor)
+{
+  if (pReactor->backend == REACTOR_URING)
+    uring_flush(pReactor->uring, FLUSH_TIMEOUT);
+  else
+    reactor_drain(pReactor, FLUSH_TIMEOUT);
+}
+
+/*
+ * Reactor_drain()
+ *
+ * Writes the output still queued for our epoll sockets,
+ * waiting for the slow ones untill timeout milliseconds
+ * have passed. Sockets which fail are hung up as usual.
+ */
+void reactor_drain(REACTOR *pReactor, int timeout)
+{
+  struct pollfd *pfd;
+  struct timespec start, now;
+  D_SOCKET *dsock;
+  int i, count, elapsed;
+
+  if ((pfd = malloc(pReactor->table_size * sizeof(*pfd))) == NULL)
+    return;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  for (;;)
+  {
+    for (i = 0, count = 0; i < pReactor->table_size; i++)
+    {
+      if ((dsock = pReactor->table[i]) == NULL || dsock->hangup || dsock->send_first == NULL)
+        continue;
+
+      net_writable(dsock);
+
+      if (!dsock->hangup && dsock->send_first != NULL)
+      {
+        pfd[count].fd = dsock->control;
+        pfd[count].events = POLLOUT;
+        pfd[count].revents = 0;
+        count++;
+      }
+    }
+
+    if (count == 0)
+      break;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed = (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+    if (elapsed >= timeout)
+      break;
+
+    if (poll(pfd, count, timeout - elapsed) < 0 && errno != EINTR)
+      break;
+  }
+
+  free(pfd);
+}
+
+/*
+ * Reactor_wake()
+ *
+ * Wakes up whoever is waiting in reactor_poll(),
+ * this is safe to call from any thread.
+ */
+void reactor_wake(REACTOR *pReactor)
+{
+  uint64_t count = 1;
+
+  if (write(pReactor->wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+    perror("Reactor_wake: write");
+}
@@ -0,0 +1,73 @@
+/* reactor.h
+ *
+ * This file contains the reactor data structure, which is used
+ * to wait for activity on the listening socket and on all the
+ * connected sockets, and to map that activity back to a socket.
+ */
+
+/* how many ready descriptors we handle for each wait */
+#define REACTOR_EVENTS         256
+
+/* the initial size of the descriptor -> socket table */
+#define REACTOR_TABLE_SIZE     256
+
+/* the most listening sockets, and connections we accept each poll */
+#define REACTOR_LISTENERS        8
+#define ACCEPT_BUDGET           64
+
+/* how many milliseconds we wait for output to be sent before a copyover */
+#define FLUSH_TIMEOUT         1000
+
+/* the different reactor backends */
+#define REACTOR_EPOLL            0
+#define REACTOR_URING            1
+
+/* io_uring backend sizes */
+#define URING_ENTRIES         1024    /* submission queue entries            */
+#define URING_BUFFERS          512    /* provided input buffers, power of 2  */
+#define URING_BUFFER_SIZE     2048    /* size of each input buffer           */
+#define URING_SEND_MAX       65536    /* output copied for one socket        */
+#define URING_MIN_MAJOR          6    /* the oldest kernel with everything   */
+#define URING_MIN_MINOR          0    /* we use, multishot recv came in 6.0  */
+
+/* the reactor structure */
+struct reactor_data
+{
+  sh_int             backend;          /* REACTOR_EPOLL or REACTOR_URING      */
+  URING            * uring;            /* the ring, if using io_uring         */
+  int                poll_fd;          /* the epoll descriptor                */
+  int                listeners[REACTOR_LISTENERS];  /* sockets accepting connections */
+  int                listener_count;   /* how many listeners we have          */
+  int                wake_fd;          /* eventfd used to wake up a wait      */
+  int                timer_fd;         /* timerfd for the next deadline       */
+  D_SOCKET        ** table;            /* maps a descriptor to it's socket    */
+  int                table_size;       /* number of slots in the table        */
+};
+
+/* the reactor used by the game loop */
+extern REACTOR *reactor;
+
+/* functions which can be accessed outside reactor.c */
+REACTOR  *init_reactor           ( int backend );
+bool      reactor_add_listener   ( REACTOR *pReactor, int listener );
+void      reactor_set_timer      ( REACTOR *pReactor, const struct timespec *deadline );
+bool      reactor_add_socket     ( REACTOR *pReactor, D_SOCKET *dsock );
+void      reactor_del_socket     ( REACTOR *pReactor, D_SOCKET *dsock );
+void      reactor_want_write     ( REACTOR *pReactor, D_SOCKET *dsock, bool on );
+D_SOCKET *reactor_lookup         ( REACTOR *pReactor, int fd );
+void      reactor_poll           ( REACTOR *pReactor, int timeout );
+int       reactor_writev         ( REACTOR *pReactor, D_SOCKET *dsock, const struct iovec *iov, int count );
+void      reactor_submit         ( REACTOR *pReactor );
+void      reactor_flush          ( REACTOR *pReactor );
+void      reactor_wake           ( REACTOR *pReactor );
+
+/* functions which can be accessed outside uring.c */
+URING    *init_uring             ( int wake_fd );
+bool      uring_add_listener     ( URING *ring, int listener );
+void      uring_add_timer        ( URING *ring, int timer_fd );
+bool      uring_add_socket       ( URING *ring, D_SOCKET *dsock );
+void      uring_del_socket       ( URING *ring, D_SOCKET *dsock );
+int       uring_write            ( URING *ring, D_SOCKET *dsock, const char *txt, int length );
+void      uring_submit           ( URING *ring );
+void      uring_poll             ( URING *ring, int timeout );
+void      uring_flush            ( URING *ring, int timeout );
@@ -0,0 +1,204 @@
+/*
+ * This file contains the byte scanners. The scalar versions work
+ * everywhere, and on x86 we also have SSE2 and AVX2 versions,
+ * which check 16 or 32 bytes with a few instructions. The AVX2
+ * code is compiled for that cpu only, so it is not used unless
+ * init_scan() finds that the cpu supports it.
+ */
+
+#include <sys/types.h>
+#include <stdio.h>
+#include <string.h>
+
+/* including main header file */
+#include "mud.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_X86
+#endif
+
+/* local procedures */
+int       scan_text_scalar      ( const char *data, int length );
+int       scan_byte_scalar      ( const char *data, int length, char c );
+#ifdef SCAN_X86
+int       scan_text_sse2        ( const char *data, int length );
+int       scan_byte_sse2        ( const char *data, int length, char c );
+int       scan_text_avx2        ( const char *data, int length );
+int       scan_byte_avx2        ( const char *data, int length, char c );
+#endif
+
+/* the scanners in use */
+int (* scan_text) ( const char *data, int length )         = scan_text_scalar;
+int (* scan_byte) ( const char *data, int length, char c ) = scan_byte_scalar;
+int    scan_type = SCAN_SCALAR;
+
+/*
+ * Init_scan()
+ *
+ * Picks the scanners to use. With SCAN_BEST we use the fastest
+ * version the cpu supports. Returns FALSE if the cpu cannot run
+ * the version asked for, in which case nothing is changed.
+ */
+bool init_scan(int type)
+{
+#ifdef SCAN_X86
+  __builtin_cpu_init();
+
+  if (type == SCAN_BEST)
+    type = __builtin_cpu_supports("avx2") ? SCAN_AVX2 : SCAN_SSE2;
+#else
+  if (type == SCAN_BEST)
+    type = SCAN_SCALAR;
+#endif
+
+  switch(type)
+  {
+    default:
+      return FALSE;
+    case SCAN_SCALAR:
+      scan_text = scan_text_scalar;
+      scan_byte = scan_byte_scalar;
+      break;
+#ifdef SCAN_X86
+    case SCAN_SSE2:
+      if (!__builtin_cpu_supports("sse2"))
+        return FALSE;
+      scan_text = scan_text_sse2;
+      scan_byte = scan_byte_sse2;
+      break;
+    case SCAN_AVX2:
+      if (!__builtin_cpu_supports("avx2"))
+        return FALSE;
+      scan_text = scan_text_avx2;
+      scan_byte = scan_byte_avx2;
+      break;
+#endif
+  }
+
+  scan_type = type;
+  return TRUE;
+}
+
+const char *scan_name()
+{
+  switch(scan_type)
+  {
+    default:
+    case SCAN_SCALAR: return "scalar";
+    case SCAN_SSE2:   return "SSE2";
+    case SCAN_AVX2:   return "AVX2";
+  }
+}
+
+int scan_text_scalar(const char *data, int length)
+{
+  unsigned char c;
+  int i;
+
+  for (i = 0; i < length; i++)
+  {
+    c = (unsigned char) data[i];
+    if (c < 0x20 || c > 0x7e)
+      break;
+  }
+
+  return i;
+}
+
+int scan_byte_scalar(const char *data, int length, char c)
+{
+  int i;
+
+  for (i = 0; i < length; i++)
+  {
+    if (data[i] == c)
+      break;
+  }
+
+  return i;
+}
+
+#ifdef SCAN_X86
+
+/*
+ * The compares are signed, so bytes above 0x7f count as
+ * negative, and are caught by the test for control codes.
+ */
+__attribute__((target("sse2")))
+int scan_text_sse2(const char *data, int length)
+{
+  const __m128i low  = _mm_set1_epi8(0x20);
+  const __m128i high = _mm_set1_epi8(0x7e);
+  __m128i x;
+  int i, mask;
+
+  for (i = 0; i + 16 <= length; i += 16)
+  {
+    x = _mm_loadu_si128((const __m128i *) (data + i));
+    mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmplt_epi8(x, low), _mm_cmpgt_epi8(x, high)));
+    if (mask != 0)
+      return i + __builtin_ctz(mask);
+  }
+
+  return i + scan_text_scalar(data + i, length - i);
+}
+
+__attribute__((target("sse2")))
+int scan_byte_sse2(const char *data, int length, char c)
+{
+  const __m128i match = _mm_set1_epi8(c);
+  __m128i x;
+  int i, mask;
+
+  for (i = 0; i + 16 <= length; i += 16)
+  {
+    x = _mm_loadu_si128((const __m128i *) (data + i));
+    mask = _mm_movemask_epi8(_mm_cmpeq_epi8(x, match));
+    if (mask != 0)
+      return i + __builtin_ctz(mask);
+  }
+
+  return i + scan_byte_scalar(data + i, length - i, c);
+}
+
+__attribute__((target("avx2")))
+int scan_text_avx2(const char *data, int length)
+{
+  const __m256i low  = _mm256_set1_epi8(0x20);
+  const __m256i high = _mm256_set1_epi8(0x7e);
+  __m256i x;
+  unsigned int mask;
+  int i;
+
+  for (i = 0; i + 32 <= length; i += 32)
+  {
+    x = _mm256_loadu_si256((const __m256i *) (data + i));
+    mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpgt_epi8(low, x), _mm256_cmpgt_epi8(x, high)));
+    if (mask != 0)
+      return i + __builtin_ctz(mask);
+  }
+
+  return i + scan_text_sse2(data + i, length - i);
+}
+
+__attribute__((target("avx2")))
+int scan_byte_avx2(const char *data, int length, char c)
+{
+  const __m256i match = _mm256_set1_epi8(c);
+  __m256i x;
+  unsigned int mask;
+  int i;
+
+  for (i = 0; i + 32 <= length; i += 32)
+  {
+    x = _mm256_loadu_si256((const __m256i *) (data + i));
+    mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(x, match));
+    if (mask != 0)
+      return i + __builtin_ctz(mask);
+  }
+
+  return i + scan_byte_sse2(data + i, length - i, c);
+}
+
+#endif
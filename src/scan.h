@@ -0,0 +1,21 @@
+/* scan.h
+ *
+ * This file contains the byte scanners used on everything going
+ * in and out of the server. Each scanner finds the next byte we
+ * have to look at, so the plain text in between can be copied in
+ * one go. The fastest version the cpu supports is picked at boot.
+ */
+
+/* the different scanners */
+#define SCAN_BEST                0  /* whatever the cpu supports */
+#define SCAN_SCALAR              1  /* one byte at a time        */
+#define SCAN_SSE2                2  /* 16 bytes at a time        */
+#define SCAN_AVX2                3  /* 32 bytes at a time        */
+
+/* the scanners in use, both return length if nothing is found */
+extern int (* scan_text) ( const char *data, int length );          /* not printable ascii */
+extern int (* scan_byte) ( const char *data, int length, char c );  /* the byte c          */
+
+/* functions which can be accessed outside scan.c */
+bool      init_scan              ( int type );
+const char *scan_name            ( void );
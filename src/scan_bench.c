@@ -0,0 +1,256 @@
+/*
+ * This file contains a small benchmark for the byte scanners in
+ * scan.c. It runs the input scan (as done by the telnet parser)
+ * and the colour tag scan (as done by text_to_buffer) over the
+ * help files and over some generated chat, first with the old
+ * byte by byte loops, and then with each scanner the cpu has.
+ *
+ * Build and run it from the src directory with "make bench".
+ */
+
+#include <sys/types.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <dirent.h>
+#include <time.h>
+
+/* including main header file */
+#include "mud.h"
+
+#define BENCH_SIZE      (1024 * 1024)   /* the size of each text      */
+#define BENCH_SECS      0.25            /* how long we time each test */
+
+/* local procedures */
+int       load_help_text        ( char *buf, int size );
+int       make_chat_text        ( char *buf, int size );
+int       old_text_loop         ( const char *data, int length, char *out );
+int       old_tag_loop          ( const char *data, int length, char *out );
+int       new_text_loop         ( const char *data, int length, char *out );
+int       new_tag_loop          ( const char *data, int length, char *out );
+double    bench                 ( int (*loop)(const char *, int, char *), const char *data, int length );
+
+/* we copy the plain text here, like the real code does */
+char bench_out[BENCH_SIZE];
+
+int main(int argc, char **argv)
+{
+  const char *names[] = { "help", "chat" };
+  const int types[]   = { SCAN_SCALAR, SCAN_SSE2, SCAN_AVX2 };
+  char *texts[2];
+  int lengths[2], i, j;
+
+  texts[0] = malloc(BENCH_SIZE);
+  texts[1] = malloc(BENCH_SIZE);
+  if (texts[0] == NULL || texts[1] == NULL)
+  {
+    fprintf(stderr, "Cannot allocate memory.\n");
+    return 1;
+  }
+
+  if ((lengths[0] = load_help_text(texts[0], BENCH_SIZE)) == 0)
+  {
+    fprintf(stderr, "No help files found in ../help/\n");
+    return 1;
+  }
+  lengths[1] = make_chat_text(texts[1], BENCH_SIZE);
+
+  printf("%-6s %-6s %12s", "text", "scan", "per-byte");
+  for (j = 0; j < 3; j++)
+  {
+    if (init_scan(types[j]))
+      printf(" %12s", scan_name());
+  }
+  printf("   (MB/s)\n");
+
+  for (i = 0; i < 2; i++)
+  {
+    printf("%-6s %-6s %12.0f", names[i], "input", bench(old_text_loop, texts[i], lengths[i]));
+    for (j = 0; j < 3; j++)
+    {
+      if (init_scan(types[j]))
+        printf(" %12.0f", bench(new_text_loop, texts[i], lengths[i]));
+    }
+    printf("\n");
+
+    printf("%-6s %-6s %12.0f", names[i], "tags", bench(old_tag_loop, texts[i], lengths[i]));
+    for (j = 0; j < 3; j++)
+    {
+      if (init_scan(types[j]))
+        printf(" %12.0f", bench(new_tag_loop, texts[i], lengths[i]));
+    }
+    printf("\n");
+  }
+
+  return 0;
+}
+
+/*
+ * Load_help_text()
+ *
+ * Fills the buffer with copies of the help files.
+ */
+int load_help_text(char *buf, int size)
+{
+  struct dirent *entry;
+  char path[MAX_BUFFER];
+  DIR *dir;
+  FILE *fp;
+  int length = 0, last = -1, got;
+
+  /* keep going round the help files untill the buffer is full */
+  while (length < size && length != last)
+  {
+    last = length;
+
+    if ((dir = opendir("../help")) == NULL)
+      return 0;
+
+    while ((entry = readdir(dir)) != NULL && length < size)
+    {
+      if (entry->d_name[0] == '.')
+        continue;
+
+      snprintf(path, MAX_BUFFER, "../help/%s", entry->d_name);
+      if ((fp = fopen(path, "r")) == NULL)
+        continue;
+
+      got = fread(buf + length, 1, size - length, fp);
+      length += got;
+      fclose(fp);
+    }
+    closedir(dir);
+  }
+
+  return length;
+}
+
+/*
+ * Make_chat_text()
+ *
+ * Fills the buffer with lines like the ones players send,
+ * with a colour tag now and then.
+ */
+int make_chat_text(char *buf, int size)
+{
+  const char *who[]   = { "Bob", "Alice", "Grimwald", "Tess" };
+  const char *words[] = { "hello", "there", "anyone", "want", "to", "group", "for",
+                          "the", "dragon", "later", "tonight", "sure", "lol", "brb" };
+  char line[MAX_BUFFER];
+  int length = 0, n, i, count;
+
+  srand(42);
+
+  for (;;)
+  {
+    n = snprintf(line, MAX_BUFFER, "%s says '", who[rand() % 4]);
+
+    count = 3 + rand() % 10;
+    for (i = 0; i < count; i++)
+    {
+      if (rand() % 16 == 0)
+        n += snprintf(line + n, MAX_BUFFER - n, "#y%s#n ", words[rand() % 14]);
+      else
+        n += snprintf(line + n, MAX_BUFFER - n, "%s ", words[rand() % 14]);
+    }
+    /* replace the last space with the end of the line */
+    n--;
+    n += snprintf(line + n, MAX_BUFFER - n, "'.\n\r");
+
+    if (length + n > size)
+      break;
+
+    memcpy(buf + length, line, n);
+    length += n;
+  }
+
+  return length;
+}
+
+/* the telnet parser before the scanners, one byte at a time */
+int old_text_loop(const char *data, int length, char *out)
+{
+  unsigned char c;
+  int i, o = 0;
+
+  for (i = 0; i < length; i++)
+  {
+    c = (unsigned char) data[i];
+    if (c >= 0x20 && c <= 0x7e)
+      out[o++] = c;
+  }
+
+  return o;
+}
+
+/* text_to_buffer() before the scanners, one byte at a time */
+int old_tag_loop(const char *data, int length, char *out)
+{
+  int i, o = 0;
+
+  for (i = 0; i < length; i++)
+  {
+    if (data[i] != '#')
+      out[o++] = data[i];
+  }
+
+  return o;
+}
+
+/* the telnet parser, copying the spans between special bytes */
+int new_text_loop(const char *data, int length, char *out)
+{
+  int i = 0, o = 0, span;
+
+  while (i < length)
+  {
+    span = scan_text(data + i, length - i);
+    memcpy(out + o, data + i, span);
+    o += span;
+    i += span + 1;
+  }
+
+  return o;
+}
+
+/* text_to_buffer(), copying the spans between colour tags */
+int new_tag_loop(const char *data, int length, char *out)
+{
+  int i = 0, o = 0, span;
+
+  while (i < length)
+  {
+    span = scan_byte(data + i, length - i, '#');
+    memcpy(out + o, data + i, span);
+    o += span;
+    i += span + 1;
+  }
+
+  return o;
+}
+
+/*
+ * Bench()
+ *
+ * Runs a loop over the text for a while, and returns
+ * how many megabytes of text it handled each second.
+ */
+double bench(int (*loop)(const char *, int, char *), const char *data, int length)
+{
+  struct timespec start, now;
+  double secs;
+  long long bytes = 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  do
+  {
+    (*loop)(data, length, bench_out);
+    bytes += length;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    secs = (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+  } while (secs < BENCH_SECS);
+
+  return bytes / secs / (1024 * 1024);
+}
@@ -4,7 +4,6 @@
  * sockets, and closing down unused sockets.
  */
 
-#include <sys/time.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <sys/socket.h>
@@ -15,17 +14,19 @@
 #include <unistd.h>
 #include <ctype.h>
 #include <time.h>
-#include <sys/ioctl.h>
+#include <stddef.h>
 #include <errno.h>
+#include <signal.h>
 
 /* including main header file */
 #include "mud.h"
 
 /* global variables */
-fd_set     fSet;                  /* the socket list for polling       */
 STACK    * dsock_free = NULL;     /* the socket free list              */
 LIST     * dsock_list = NULL;     /* the linked list of active sockets */
 STACK    * dmobile_free = NULL;   /* the mobile free list              */
+STACK    * output_free = NULL;    /* the output chunk free list        */
+STACK    * link_free = NULL;      /* the segment chunk free list       */
 LIST     * dmobile_list = NULL;   /* the mobile list of active mobiles */
 
 /* mccp support */
@@ -34,45 +35,123 @@ const unsigned char compress_will2  [] = { IAC, WILL, TELOPT_COMPRESS2, '\0' };
 const unsigned char do_echo         [] = { IAC, WONT, TELOPT_ECHO,      '\0' };
 const unsigned char dont_echo       [] = { IAC, WILL, TELOPT_ECHO,      '\0' };
 
+/* sent just before we drop a flooding socket */
+const char input_overflow [] = "\n\r!!!! Input Overflow !!!!\n\r";
+
+/* sent where we cut off output which did not fit in the queue */
+const char output_overflow [] = "\033[0m\n\r!!!! Output Overflow !!!!\n\r";
+
+/* how much output we queue for a socket each pulse, see -maxoutput */
+int max_output = MAX_OUTPUT;
+
 /* local procedures */
-void GameLoop         ( int control );
+void GameLoop         ( void );
+void nsecs_to_timespec( long long nsecs, struct timespec *ts );
+bool render_to_queue  ( void *arg, const char *txt, int length );
+void append_output    ( D_SOCKET *dsock, const char *txt, int length );
+void free_chunk       ( OUT_CHUNK *chunk );
 
 /* intialize shutdown state */
 bool shut_down = FALSE;
-int  control;
+
+/* the sockets we accept connections on */
+int  listeners[REACTOR_LISTENERS];
+int  listener_count = 0;
+
+/* the rendered prompt */
+TEMPLATE prompt_tpl;
 
 /*
  * This is where it all starts, nothing special.
  */
 int main(int argc, char **argv)
 {
+  char *listen_spec[REACTOR_LISTENERS];
+  char default_spec[MAX_BUFFER];
   bool fCopyOver;
+  int i, backend = REACTOR_EPOLL, threads = NET_THREADS, spec_count = 0;
 
-  /* get the current time */
-  current_time = time(NULL);
+  /* get the current time, and seed the random numbers with it */
+  update_time();
+  srand(time(NULL));
 
   /* allocate memory for socket and mobile lists'n'stacks */
   dsock_free = AllocStack();
   dsock_list = AllocList();
   dmobile_free = AllocStack();
   dmobile_list = AllocList();
+  output_free = AllocStack();
+  link_free = AllocStack();
 
   /* note that we are booting up */
   log_string("Program starting.");
 
+  /* pick the fastest byte scanners this cpu has */
+  init_scan(SCAN_BEST);
+  log_string("Init_scan: using %s scanners.", scan_name());
+
+  /* writes to a dead connection should fail, not kill us */
+  signal(SIGPIPE, SIG_IGN);
+
   /* initialize the event queue - part 1 */
   init_event_queue(1);
 
-  if (argc > 2 && !strcmp(argv[argc-1], "copyover") && atoi(argv[argc-2]) > 0)
+  /* check for startup options */
+  for (i = 1; i < argc; i++)
   {
-    fCopyOver = TRUE;
-    control = atoi(argv[argc-2]);
+    if (!strcmp(argv[i], "-uring"))
+      backend = REACTOR_URING;
+    else if (!strcmp(argv[i], "-threads") && i < argc - 1)
+      threads = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "-maxoutput") && i < argc - 1)
+      max_output = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "-listen") && i < argc - 1 && spec_count < REACTOR_LISTENERS)
+      listen_spec[spec_count++] = argv[++i];
+    else if (!strcmp(argv[i], "-listenfd") && i < argc - 1 && listener_count < REACTOR_LISTENERS)
+      listeners[listener_count++] = atoi(argv[++i]);
   }
-  else fCopyOver = FALSE;
 
-  /* initialize the socket */
+  /* the queue must at least hold a chunk */
+  max_output = UMAX(max_output, OUTPUT_CHUNK);
+
+  /* after a copyover, the listeners are passed to us */
+  fCopyOver = (argc > 1 && !strcmp(argv[argc-1], "copyover") && listener_count > 0);
+
+  /* initialize the sockets, by default we listen on MUDPORT */
   if (!fCopyOver)
-    control = init_socket();
+  {
+    listener_count = 0;
+
+    if (spec_count == 0)
+    {
+      snprintf(default_spec, MAX_BUFFER, "%d", MUDPORT);
+      listen_spec[spec_count++] = default_spec;
+    }
+
+    for (i = 0; i < spec_count; i++)
+    {
+      if ((listeners[listener_count] = init_socket(listen_spec[i])) < 0)
+        exit(1);
+      listener_count++;
+    }
+  }
+
+  /* start watching the sockets for connections */
+  reactor = init_reactor(backend);
+  for (i = 0; i < listener_count; i++)
+  {
+    if (!reactor_add_listener(reactor, listeners[i]))
+      exit(1);
+  }
+
+  /* start the network threads */
+  init_net(threads, backend);
+
+  /* start the resolver threads */
+  init_dns();
+
+  /* start the compression workers */
+  init_mccp();
 
   /* load all external data */
   load_muddata(fCopyOver);
@@ -81,10 +160,14 @@ int main(int argc, char **argv)
   init_event_queue(2);
 
   /* main game loop */
-  GameLoop(control);
+  GameLoop();
 
-  /* close down the socket */
-  close(control);
+  /* send the last output, and stop the network threads */
+  net_stop();
+
+  /* close down the sockets */
+  for (i = 0; i < listener_count; i++)
+    close(listeners[i]);
 
   /* terminated without errors */
   log_string("Program terminated without errors.");
@@ -93,95 +176,58 @@ int main(int argc, char **argv)
   return 0;
 }
 
-void GameLoop(int control)   
+/*
+ * Nsecs_to_timespec()
+ *
+ * Turns a CLOCK_MONOTONIC time in nanoseconds back into a timespec.
+ */
+void nsecs_to_timespec(long long nsecs, struct timespec *ts)
+{
+  ts->tv_sec  = nsecs / 1000000000LL;
+  ts->tv_nsec = nsecs % 1000000000LL;
+}
+
+void GameLoop()   
 {
   D_SOCKET *dsock;
   ITERATOR Iter;
-  static struct timeval tv;
-  struct timeval last_time, new_time;
-  extern fd_set fSet;
-  fd_set rFd;
-  long secs, usecs;
+  struct timespec deadline;
+  long long next_pulse, pass_start, missed, due;
+  bool waiting = FALSE;
+  int pulses;
 
-  /* set this for the first loop */
-  gettimeofday(&last_time, NULL);
-
-  /* clear out the file socket set */
-  FD_ZERO(&fSet);
-
-  /* add control to the set */
-  FD_SET(control, &fSet);
-
-  /* copyover recovery */
-  AttachIterator(&Iter, dsock_list);
-  while ((dsock = (D_SOCKET *) NextInList(&Iter)) != NULL)
-    FD_SET(dsock->control, &fSet);
-  DetachIterator(&Iter);
+  /* the pulses are kept on a fixed schedule from here on */
+  update_time();
+  next_pulse = current_mono + PULSE_NSECS;
+  nsecs_to_timespec(next_pulse, &deadline);
+  reactor_set_timer(reactor, &deadline);
 
   /* do this untill the program is shutdown */
   while (!shut_down)
   {
-    /* set current_time */
-    current_time = time(NULL);
+    /*
+     * Wait for input, or for the pulse timer to go off. The
+     * network threads and the resolver wake us up when they
+     * have something for us. If commands are still waiting
+     * we just check for more input.
+     */
+    reactor_poll(reactor, waiting ? 0 : -1);
 
-    /* copy the socket set */
-    memcpy(&rFd, &fSet, sizeof(fd_set));
+    /* this is the time for everything we do in this pass */
+    update_time();
+    pass_start = current_mono;
 
-    /* wait for something to happen */
-    if (select(FD_SETSIZE, &rFd, NULL, NULL, &tv) < 0)
-      continue;
+    /* collect input and hangups from the network threads */
+    net_game_listen();
+    handle_net_messages();
 
-    /* check for new connections */
-    if (FD_ISSET(control, &rFd))
-    {
-      struct sockaddr_in sock;
-      unsigned int socksize;
-      int newConnection;
-
-      socksize = sizeof(sock);
-      if ((newConnection = accept(control, (struct sockaddr*) &sock, &socksize)) >=0)
-        new_socket(newConnection);
-    }
+    /* handle the commands waiting on the sockets */
+    waiting = handle_cmd_queues();
 
-    /* poll sockets in the socket list */
+    /* handle output on the sockets in the socket list */
     AttachIterator(&Iter ,dsock_list);
     while ((dsock = (D_SOCKET *) NextInList(&Iter)) != NULL)
     {
-      /*
-       * Close sockects we are unable to read from.
-       */
-      if (FD_ISSET(dsock->control, &rFd) && !read_from_socket(dsock))
-      {
-        close_socket(dsock, FALSE);
-        continue;
-      }
-
-      /* Ok, check for a new command */
-      next_cmd_from_buffer(dsock);
-
-      /* Is there a new command pending ? */
-      if (dsock->next_command[0] != '\0')
-      {
-        /* figure out how to deal with the incoming command */
-        switch(dsock->state)
-        {
-          default:
-            bug("Descriptor in bad state.");
-            break;
-          case STATE_NEW_NAME:
-          case STATE_NEW_PASSWORD:
-          case STATE_VERIFY_PASSWORD:
-          case STATE_ASK_PASSWORD:
-            handle_new_connections(dsock, dsock->next_command);
-            break;
-          case STATE_PLAYING:
-            handle_cmd_input(dsock, dsock->next_command);
-            break;
-        }
-
-        dsock->next_command[0] = '\0';
-      }
-
       /* if the player quits or get's disconnected */
       if (dsock->state == STATE_CLOSED) continue;
 
@@ -191,84 +237,140 @@ void GameLoop(int control)
     }
     DetachIterator(&Iter);
 
-    /* call the event queue */
-    heartbeat();
-
     /*
-     * Here we sleep out the rest of the pulse, thus forcing
-     * SocketMud(tm) to run at PULSES_PER_SECOND pulses each second.
+     * The game itself runs at PULSES_PER_SECOND pulses each second,
+     * no matter how often we handle input and output.
      */
-    gettimeofday(&new_time, NULL);
-
-    /* get the time right now, and calculate how long we should sleep */
-    usecs = (int) (last_time.tv_usec -  new_time.tv_usec) + 1000000 / PULSES_PER_SECOND;
-    secs  = (int) (last_time.tv_sec  -  new_time.tv_sec);
-
-    /*
-     * Now we make sure that 0 <= usecs < 1.000.000
-     */
-    while (usecs < 0)
-    {
-      usecs += 1000000;
-      secs  -= 1;
-    }
-    while (usecs >= 1000000)
+    if (current_mono >= next_pulse)
     {
-      usecs -= 1000000;
-      secs  += 1;
-    }
+      /* did we fall into a laghole ? */
+      missed = (current_mono - next_pulse) / PULSE_NSECS;
+      if (missed >= PULSES_PER_SECOND)
+        log_string("GameLoop: laghole, %lld pulses missed.", missed);
 
-    /* if secs < 0 we don't sleep, since we have encountered a laghole */
-    if (secs > 0 || (secs == 0 && usecs > 0))
-    {
-      struct timeval sleep_time;
+      switch(PULSE_CATCHUP)
+      {
+        default:
+        case PULSE_SKIP:
+          pulses = 1;
+          break;
+        case PULSE_COMPRESS:
+          pulses = 1 + UMIN(missed, CATCHUP_PULSES);
+          break;
+        case PULSE_REPLAY:
+          pulses = 1 + missed;
+          break;
+      }
+
+      /* call the event queue, telling it when each pulse was due */
+      due = next_pulse + (missed + 1 - pulses) * PULSE_NSECS;
+      while (pulses-- > 0)
+      {
+        heartbeat(due);
+        due += PULSE_NSECS;
+      }
 
-      sleep_time.tv_usec = usecs;
-      sleep_time.tv_sec  = secs;
+      /* recycle sockets */
+      recycle_sockets();
 
-      if (select(0, NULL, NULL, NULL, &sleep_time) < 0)
-        continue;
+      /* the next pulse stays on the same schedule, so we never drift */
+      next_pulse += (missed + 1) * PULSE_NSECS;
+      nsecs_to_timespec(next_pulse, &deadline);
+      reactor_set_timer(reactor, &deadline);
     }
 
-    /* reset the last time we where sleeping */
-    gettimeofday(&last_time, NULL);
+    /* hand this pass's output to the network threads */
+    net_kick();
+
+    /* let the compression level follow how busy we are */
+    mccp_adjust(pass_start);
 
-    /* recycle sockets */
-    recycle_sockets();
+    /*
+     * We never do more than PASSES_PER_SECOND passes each second,
+     * so a flood of input gets handled in batches. If we are done
+     * early, we sleep out the rest of the pass.
+     */
+    nsecs_to_timespec(pass_start + 1000000000LL / PASSES_PER_SECOND, &deadline);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR)
+      ;
   }
 }
 
 /*
  * Init_socket()
  *
- * Used at bootup to get a free
- * socket to run the server from.
+ * Used at bootup to get a socket to run the server from.
+ * The spec is either a port, which listens on all IPv4
+ * addresses, or an address and a port, like 10.0.0.1:4000
+ * or [::]:4000. Several processes may share a port, since
+ * we use SO_REUSEPORT. Returns -1 on errors.
  */
-int init_socket()
+int init_socket(const char *spec)
 {
-  struct sockaddr_in my_addr;
-  int sockfd, reuse = 1;
+  struct addrinfo hints, *addr;
+  char buf[MAX_BUFFER];
+  char *host = NULL, *port;
+  int sockfd, status, reuse = 1;
+
+  /* split the spec into address and port */
+  strncpy(buf, spec, MAX_BUFFER - 1);
+  buf[MAX_BUFFER - 1] = '\0';
+  if ((port = strrchr(buf, ':')) != NULL)
+  {
+    *port++ = '\0';
+    host = buf;
 
-  /* let's grab a socket */
-  sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    /* IPv6 addresses are written in brackets */
+    if (host[0] == '[' && host[strlen(host) - 1] == ']')
+    {
+      host[strlen(host) - 1] = '\0';
+      host++;
+    }
+  }
+  else port = buf;
 
-  /* setting the correct values */
-  my_addr.sin_family = AF_INET;
-  my_addr.sin_addr.s_addr = INADDR_ANY;
-  my_addr.sin_port = htons(MUDPORT);
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family   = (host == NULL) ? AF_INET : AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags    = AI_PASSIVE | AI_NUMERICHOST | AI_NUMERICSERV;
+
+  if ((status = getaddrinfo(host, port, &hints, &addr)) != 0)
+  {
+    log_string("Init_socket: bad address %s (%s).", spec, gai_strerror(status));
+    return -1;
+  }
+
+  /* let's grab a socket, accept4() needs it to be non-blocking */
+  if ((sockfd = socket(addr->ai_family, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0)
+  {
+    perror("Init_socket: socket");
+    freeaddrinfo(addr);
+    return -1;
+  }
 
   /* this actually fixes any problems with threads */
-  if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(int)) == -1)
+  if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(int)) == -1 ||
+      setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(int)) == -1)
   {
     perror("Error in setsockopt()");
     exit(1);
   } 
 
-  /* bind the port */
-  bind(sockfd, (struct sockaddr *) &my_addr, sizeof(struct sockaddr));
+  /* so we can listen on the same port with IPv4 and IPv6 */
+  if (addr->ai_family == AF_INET6)
+    setsockopt(sockfd, IPPROTO_IPV6, IPV6_V6ONLY, &reuse, sizeof(int));
+
+  /* bind the port, and start listening already :) */
+  if (bind(sockfd, addr->ai_addr, addr->ai_addrlen) < 0 || listen(sockfd, LISTEN_BACKLOG) < 0)
+  {
+    log_string("Init_socket: cannot listen on %s (%s).", spec, strerror(errno));
+    close(sockfd);
+    freeaddrinfo(addr);
+    return -1;
+  }
+  freeaddrinfo(addr);
 
-  /* start listening already :) */
-  listen(sockfd, 3);
+  log_string("Init_socket: listening on %s.", spec);
 
   /* return the socket */
   return sockfd;
@@ -282,18 +384,11 @@ int init_socket()
  */
 bool new_socket(int sock)
 {
-  struct sockaddr_in   sock_addr;
-  pthread_attr_t       attr;
-  pthread_t            thread_lookup;
-  LOOKUP_DATA        * lData;
+  struct sockaddr_storage sock_addr;
+  char                 host[NI_MAXHOST];
   D_SOCKET           * sock_new;
-  int                  argp = 1;
   socklen_t            size;
 
-  /* initialize threads */
-  pthread_attr_init(&attr);   
-  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
-
   /*
    * allocate some memory for a new socket if
    * there is no free socket in the free_list
@@ -311,47 +406,31 @@ bool new_socket(int sock)
     sock_new = (D_SOCKET *) PopStack(dsock_free);
   }
 
-  /* attach the new connection to the socket list */
-  FD_SET(sock, &fSet);
-
   /* clear out the socket */
   clear_socket(sock_new, sock);
 
-  /* set the socket as non-blocking */
-  ioctl(sock, FIONBIO, &argp);
-
   /* update the linked list of sockets */
   AttachToList(sock_new, dsock_list);
 
+  /* hand the new connection to a network thread */
+  net_attach(sock_new);
+
   /* do a host lookup */
   size = sizeof(sock_addr);
-  if (getpeername(sock, (struct sockaddr *) &sock_addr, &size) < 0)
+  if (getpeername(sock, (struct sockaddr *) &sock_addr, &size) < 0 ||
+      getnameinfo((struct sockaddr *) &sock_addr, size, host, sizeof(host), NULL, 0, NI_NUMERICHOST) != 0)
   {
     perror("New_socket: getpeername");
     sock_new->hostname = strdup("unknown");
+    sock_new->lookup_status++;
   }
   else
   {
     /* set the IP number as the temporary hostname */
-    sock_new->hostname = strdup(inet_ntoa(sock_addr.sin_addr));
-
-    if (strcasecmp(sock_new->hostname, "127.0.0.1"))
-    {
-      /* allocate some memory for the lookup data */
-      if ((lData = malloc(sizeof(*lData))) == NULL)
-      {
-        bug("New_socket: Cannot allocate memory for lookup data.");
-        abort();
-      }
-
-      /* Set the lookup_data for use in lookup_address() */
-      lData->buf    =  strdup((char *) &sock_addr.sin_addr);
-      lData->dsock  =  sock_new;
+    sock_new->hostname = strdup(host);
 
-      /* dispatch the lookup thread */
-      pthread_create(&thread_lookup, &attr, &lookup_address, (void*) lData);
-    }
-    else sock_new->lookup_status++;
+    /* and let the resolver pool find the real one */
+    dns_lookup(sock_new, &sock_addr, size);
   }
 
   /* negotiate compression */
@@ -359,7 +438,7 @@ bool new_socket(int sock)
   text_to_buffer(sock_new, (char *) compress_will);
 
   /* send the greeting */
-  text_to_buffer(sock_new, greeting);
+  template_to_buffer(sock_new, &greeting_tpl, greeting);
   text_to_buffer(sock_new, "What is your name? ");
 
   /* initialize socket events */
@@ -379,14 +458,10 @@ bool new_socket(int sock)
 void close_socket(D_SOCKET *dsock, bool reconnect)
 {
   EVENT_DATA *pEvent;
-  ITERATOR Iter;
 
   if (dsock->lookup_status > TSTATE_DONE) return;
   dsock->lookup_status += 2;
 
-  /* remove the socket from the polling list */
-  FD_CLR(dsock->control, &fSet);
-
   if (dsock->state == STATE_PLAYING)
   {
     if (reconnect)
@@ -401,10 +476,12 @@ void close_socket(D_SOCKET *dsock, bool reconnect)
     free_mobile(dsock->player);
 
   /* dequeue all events for this socket */
-  AttachIterator(&Iter, dsock->events);
-  while ((pEvent = (EVENT_DATA *) NextInList(&Iter)) != NULL)
+  while ((pEvent = dsock->events) != NULL)
     dequeue_event(pEvent);
-  DetachIterator(&Iter);
+
+  /* send the last output, and ask the network thread to let go of the socket */
+  send_output(dsock);
+  net_post(dsock, NET_MSG_CLOSE, NULL, 0);
 
   /* set the closed state */
   dsock->state = STATE_CLOSED;
@@ -413,343 +490,484 @@ void close_socket(D_SOCKET *dsock, bool reconnect)
 /* 
  * Read_from_socket()
  *
- * Reads one line from the socket, storing it
- * in a buffer for later use. Will also close
- * the socket if it tries a buffer overflow.
+ * Reads all pending input from the socket, and hands
+ * each chunk to telnet_parse(), which passes complete
+ * lines on to the game. The reactor only tells us about
+ * new input once, so we keep reading until the socket is
+ * drained. Returns FALSE, and the socket is closed, if
+ * the read fails or the client sends too long a line.
+ *
+ * This is called by the network thread owning the socket.
  */
 bool read_from_socket(D_SOCKET *dsock)
 {
-  int size;
+  char buf[MAX_INBUF];
   extern int errno;
 
-  /* check for buffer overflows, and drop connection in that case */
-  size = strlen(dsock->inbuf);
-  if (size >= sizeof(dsock->inbuf) - 2)
-  {
-    text_to_socket(dsock, "\n\r!!!! Input Overflow !!!!\n\r");
-    return FALSE;
-  }
-
   /* start reading from the socket */
   for (;;)
   {
     int sInput;
-    int wanted = sizeof(dsock->inbuf) - 2 - size;
 
-    sInput = read(dsock->control, dsock->inbuf + size, wanted);
+    sInput = read(dsock->control, buf, sizeof(buf));
 
     if (sInput > 0)
     {
-      size += sInput;
-
-      if (dsock->inbuf[size-1] == '\n' || dsock->inbuf[size-1] == '\r')
-        break;
+      /* handle telnet options, and pass complete lines to the game */
+      if (!telnet_parse(dsock, buf, sInput))
+        return FALSE;
     }
     else if (sInput == 0)
     {
       log_string("Read_from_socket: EOF");
       return FALSE;
     }
-    else if (errno == EAGAIN || sInput == wanted)
+    else if (errno == EAGAIN || errno == EWOULDBLOCK)
       break;
+    else if (errno == EINTR)
+      continue;
     else
     {
       perror("Read_from_socket");
       return FALSE;
     }     
   }
-  dsock->inbuf[size] = '\0';
+
   return TRUE;
 }
 
 /*
  * Text_to_socket()
  *
- * Sends text directly to the socket,
- * will compress the data if needed.
+ * Sends text to the socket without any parsing. The
+ * text is added to the output queue as it is, and sent
+ * with the rest of the output at the end of the pulse.
  */
 bool text_to_socket(D_SOCKET *dsock, const char *txt)
 {
-  int iBlck, iPtr, iWrt = 0, length, control = dsock->control;
+  return output_to_buffer(dsock, txt, strlen(txt));
+}
+
+/*
+ * Write_to_socket()
+ *
+ * Queues text to be written to the socket, will
+ * compress the data if needed. Only the network
+ * thread owning the socket may call this.
+ */
+bool write_to_socket(D_SOCKET *dsock, const char *txt, int length)
+{
+  z_stream *s = dsock->out_compress;
+  struct timespec start, end;
+  uLong total_out;
+  int status;
 
-  length = strlen(txt);
+  /* the compression worker writes it for us */
+  if (mccp_offload(dsock))
+  {
+    mccp_post(dsock, alloc_net_msg(dsock, NET_MSG_DEFLATE, txt, length));
+    return TRUE;
+  }
 
-  /* write compressed */
-  if (dsock && dsock->out_compress)
+  /* write uncompressed */
+  if (s == NULL)
   {
-    dsock->out_compress->next_in  = (unsigned char *) txt;
-    dsock->out_compress->avail_in = length;
+    net_write(dsock, txt, length);
+    return TRUE;
+  }
+
+  /* follow the server's compression level */
+  compressLevel(dsock);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  total_out = s->total_out;
+
+  /* write compressed, until zlib has nothing more to give us */
+  s->next_in  = (unsigned char *) txt;
+  s->avail_in = length;
 
-    while (dsock->out_compress->avail_in)
+  do
+  {
+    s->avail_out = COMPRESS_BUF_SIZE - (s->next_out - dsock->out_compress_buf);
+
+    status = deflate(s, Z_SYNC_FLUSH);
+    if (status != Z_OK && status != Z_BUF_ERROR)
+      return FALSE;
+
+    if (!processCompressed(dsock))
+      return FALSE;
+  } while (s->avail_in > 0 || s->avail_out == 0);
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  compressAccount(dsock->compress_level, length, s->total_out - total_out,
+    (end.tv_sec - start.tv_sec) * 1000000000LL + (end.tv_nsec - start.tv_nsec));
+
+  return TRUE;
+}
+
+/* the color table, indexed by the character after the '#' */
+const struct sAnsiColor
+{
+  const char  * cString;     /* NULL if it is not a color tag */
+  int           aFlag;
+} ansiTable[256] =
+{
+  ['d'] = { "30",  eTHIN },
+  ['D'] = { "30",  eBOLD },
+  ['r'] = { "31",  eTHIN },
+  ['R'] = { "31",  eBOLD },
+  ['g'] = { "32",  eTHIN },
+  ['G'] = { "32",  eBOLD },
+  ['y'] = { "33",  eTHIN },
+  ['Y'] = { "33",  eBOLD },
+  ['b'] = { "34",  eTHIN },
+  ['B'] = { "34",  eBOLD },
+  ['p'] = { "35",  eTHIN },
+  ['P'] = { "35",  eBOLD },
+  ['c'] = { "36",  eTHIN },
+  ['C'] = { "36",  eBOLD },
+  ['w'] = { "37",  eTHIN },
+  ['W'] = { "37",  eBOLD }
+};
+
+/*
+ * Text_to_buffer()
+ *
+ * Stores outbound text in a buffer, where it will
+ * stay untill it is flushed in the gameloop.
+ *
+ * Will also parse ANSI colors and other tags.
+ */
+void text_to_buffer(D_SOCKET *dsock, const char *txt)
+{
+  /* always start with a leading space */
+  if (dsock->top_output == 0 && !output_to_buffer(dsock, "\n\r", 2))
+    return;
+
+  /* if the queue fills up, we keep the part which made it */
+  render_ansi(txt, strlen(txt), &render_to_queue, dsock);
+}
+
+/* the renderer's output function for text_to_buffer() */
+bool render_to_queue(void *arg, const char *txt, int length)
+{
+  return output_to_buffer((D_SOCKET *) arg, txt, length);
+}
+
+/*
+ * Render_ansi()
+ *
+ * Renders the text with its color tags, passing each piece
+ * to the output function as it is done. Plain text between
+ * the tags is passed on in one go, and text without any tags
+ * in a single call. Returns FALSE if the output function
+ * failed before we were done.
+ */
+bool render_ansi(const char *txt, int length, bool (* out)(void *arg, const char *txt, int length), void *arg)
+{
+  const struct sAnsiColor *last = NULL, *color;
+  const char *end = txt + length;
+  bool underline = FALSE, bold = FALSE;
+  char seq[16];
+  int iPtr, span, k;
+
+  while (txt < end)
+  {
+    /* copy everything up to the next tag in one go */
+    if ((span = scan_byte(txt, end - txt, '#')) > 0)
     {
-      dsock->out_compress->avail_out = COMPRESS_BUF_SIZE - (dsock->out_compress->next_out - dsock->out_compress_buf);
+      if (!(* out)(arg, txt, span))
+        return FALSE;
+      if ((txt += span) == end)
+        break;
+    }
+
+    /* skip the '#', a '#' at the very end is sent as it is */
+    if (++txt == end)
+    {
+      if (!(* out)(arg, "#", 1))
+        return FALSE;
+      break;
+    }
+    iPtr = 0;
 
-      if (dsock->out_compress->avail_out)
+    /* toggle underline on/off with #u */
+    if (*txt == 'u')
+    {
+      txt++;
+      if (underline)
+      {
+        underline = FALSE;
+        seq[iPtr++] =  27; seq[iPtr++] = '['; seq[iPtr++] = '0';
+        if (bold)
+        {
+          seq[iPtr++] = ';'; seq[iPtr++] = '1';
+        }
+        if (last != NULL)
+        {
+          seq[iPtr++] = ';';
+          for (k = 0; last->cString[k] != '\0'; k++)
+            seq[iPtr++] = last->cString[k];
+        }
+        seq[iPtr++] = 'm';
+      }
+      else
       {
-        int status = deflate(dsock->out_compress, Z_SYNC_FLUSH);
+        underline = TRUE;
+        seq[iPtr++] =  27; seq[iPtr++] = '[';
+        seq[iPtr++] = '4'; seq[iPtr++] = 'm';
+      }
+    }
 
-        if (status != Z_OK)
-        return FALSE;
+    /* parse ## to # */
+    else if (*txt == '#')
+    {
+      txt++;
+      seq[iPtr++] = '#';
+    }
+
+    /* #n should clear all tags */
+    else if (*txt == 'n')
+    {
+      txt++;
+      if (last != NULL || underline || bold)
+      {
+        underline = FALSE;
+        bold = FALSE;
+        seq[iPtr++] =  27; seq[iPtr++] = '[';
+        seq[iPtr++] = '0'; seq[iPtr++] = 'm';
       }
 
-      length = dsock->out_compress->next_out - dsock->out_compress_buf;
-      if (length > 0)
+      last = NULL;
+    }
+
+    /* it wasn't a valid color tag */
+    else if ((color = &ansiTable[(unsigned char) *txt])->cString == NULL)
+    {
+      seq[iPtr++] = '#';
+    }
+
+    /* we only add the color sequence if it's needed */
+    else
+    {
+      txt++;
+      if (last != color)
       {
-        for (iPtr = 0; iPtr < length; iPtr += iWrt)
+        /* remember if a color change is needed */
+        bool cSequence = (last == NULL || strcmp(last->cString, color->cString));
+
+        /* escape sequence */
+        seq[iPtr++] = 27; seq[iPtr++] = '[';
+
+        /* handle font boldness */
+        if (bold && color->aFlag == eTHIN)
         {
-          iBlck = UMIN(length - iPtr, 4096);
-          if ((iWrt = write(control, dsock->out_compress_buf + iPtr, iBlck)) < 0)
+          seq[iPtr++] = '0';
+          bold = FALSE;
+
+          if (underline)
           {
-            perror("Text_to_socket (compressed):");
-            return FALSE;
+            seq[iPtr++] = ';'; seq[iPtr++] = '4';
           }
+
+          /* changing to eTHIN wipes the old color */
+          seq[iPtr++] = ';';
+          cSequence = TRUE;
         }
-        if (iWrt <= 0) break;
-        if (iPtr > 0)
+        else if (!bold && color->aFlag == eBOLD)
         {
-          if (iPtr < length)
-            memmove(dsock->out_compress_buf, dsock->out_compress_buf + iPtr, length - iPtr);
+          seq[iPtr++] = '1';
+          bold = TRUE;
 
-          dsock->out_compress->next_out = dsock->out_compress_buf + length - iPtr;
+          if (cSequence)
+            seq[iPtr++] = ';';
         }
+
+        /* add color sequence if needed */
+        if (cSequence)
+        {
+          for (k = 0; color->cString[k] != '\0'; k++)
+            seq[iPtr++] = color->cString[k];
+        }
+
+        seq[iPtr++] = 'm';
       }
+
+      /* remember the last color */
+      last = color;
     }
-    return TRUE;
+
+    if (iPtr > 0 && !(* out)(arg, seq, iPtr))
+      return FALSE;
   }
 
-  /* write uncompressed */
-  for (iPtr = 0; iPtr < length; iPtr += iWrt)
+  /* and terminate it with the standard color */
+  if (last != NULL || underline || bold)
   {
-    iBlck = UMIN(length - iPtr, 4096);
-    if ((iWrt = write(control, txt + iPtr, iBlck)) < 0)
-    {
-      perror("Text_to_socket:");
+    if (!(* out)(arg, "\033[0m", 4))
       return FALSE;
-    }
   }
 
   return TRUE;
 }
 
 /*
- * Text_to_buffer()
- *
- * Stores outbound text in a buffer, where it will
- * stay untill it is flushed in the gameloop.
+ * Output_to_buffer()
  *
- * Will also parse ANSI colors and other tags.
+ * Appends text to the socket's output queue. If the
+ * queue would grow beyond max_output bytes, we queue
+ * the part that fits, followed by a notice that the
+ * output was cut, and return FALSE. Nothing more is
+ * queued untill the output has been sent.
  */
-void text_to_buffer(D_SOCKET *dsock, const char *txt)
+bool output_to_buffer(D_SOCKET *dsock, const char *txt, int length)
 {
-  static char output[8 * MAX_BUFFER];
-  bool underline = FALSE, bold = FALSE;
-  int iPtr = 0, last = -1, j, k;
-  int length = strlen(txt);
+  int room = max_output - dsock->top_output;
 
-  /* the color struct */
-  struct sAnsiColor
-  {
-    const char    cTag;
-    const char  * cString;
-    int           aFlag;
-  };
+  if (dsock->out_overflow)
+    return FALSE;
 
-  /* the color table... */
-  const struct sAnsiColor ansiTable[] =
+  if (length <= room)
   {
-    { 'd',  "30",  eTHIN },
-    { 'D',  "30",  eBOLD },
-    { 'r',  "31",  eTHIN },
-    { 'R',  "31",  eBOLD },
-    { 'g',  "32",  eTHIN },
-    { 'G',  "32",  eBOLD },
-    { 'y',  "33",  eTHIN },
-    { 'Y',  "33",  eBOLD },
-    { 'b',  "34",  eTHIN },
-    { 'B',  "34",  eBOLD },
-    { 'p',  "35",  eTHIN },
-    { 'P',  "35",  eBOLD },
-    { 'c',  "36",  eTHIN },
-    { 'C',  "36",  eBOLD },
-    { 'w',  "37",  eTHIN },
-    { 'W',  "37",  eBOLD },
-
-    /* the end tag */
-    { '\0',  "",   eTHIN }
-  };
-
-  if (length >= MAX_BUFFER)
-  {
-    log_string("text_to_buffer: buffer overflow.");
-    return;
+    append_output(dsock, txt, length);
+    return TRUE;
   }
 
-  /* always start with a leading space */
-  if (dsock->top_output == 0)
-  {
-    dsock->outbuf[0] = '\n';
-    dsock->outbuf[1] = '\r';
-    dsock->top_output = 2;
-  }
+  if (room > 0)
+    append_output(dsock, txt, room);
+  append_output(dsock, output_overflow, sizeof(output_overflow) - 1);
+  dsock->out_overflow = TRUE;
 
-  while (*txt != '\0')
-  {
-    /* simple bound checking */
-    if (iPtr > (8 * MAX_BUFFER - 15))
-      break;
+  bug("Output_to_buffer: output overflow on %s.", dsock->hostname);
+  return FALSE;
+}
 
-    switch(*txt)
-    {
-      default:
-        output[iPtr++] = *txt++;
-        break;
-      case '#':
-        txt++;
+/*
+ * Append_output()
+ *
+ * Appends text to the socket's output queue, taking
+ * new chunks from the free list as needed.
+ */
+void append_output(D_SOCKET *dsock, const char *txt, int length)
+{
+  OUT_CHUNK *chunk;
+  int size;
 
-        /* toggle underline on/off with #u */
-        if (*txt == 'u')
-        {
-          txt++;
-          if (underline)
-          {
-            underline = FALSE;
-            output[iPtr++] =  27; output[iPtr++] = '['; output[iPtr++] = '0';
-            if (bold)
-            {
-              output[iPtr++] = ';'; output[iPtr++] = '1';
-            }
-            if (last != -1)
-            {
-              output[iPtr++] = ';';
-              for (j = 0; ansiTable[last].cString[j] != '\0'; j++)
-              {
-                output[iPtr++] = ansiTable[last].cString[j];
-              }
-            }
-            output[iPtr++] = 'm';
-          }
-          else
-          {
-            underline = TRUE;
-            output[iPtr++] =  27; output[iPtr++] = '[';
-            output[iPtr++] = '4'; output[iPtr++] = 'm';
-          }
-        }
+  dsock->top_output += length;
 
-        /* parse ## to # */
-        else if (*txt == '#')
+  while (length > 0)
+  {
+    /* get a new chunk if the last one is full, or shared */
+    if ((chunk = dsock->out_last) == NULL || chunk->segment != NULL || chunk->len >= OUTPUT_CHUNK)
+    {
+      if (StackSize(output_free) <= 0)
+      {
+        if ((chunk = malloc(sizeof(*chunk))) == NULL)
         {
-          txt++;
-          output[iPtr++] = '#';
+          bug("Output_to_buffer: Cannot allocate memory.");
+          abort();
         }
+      }
+      else
+      {
+        chunk = (OUT_CHUNK *) PopStack(output_free);
+      }
 
-        /* #n should clear all tags */
-        else if (*txt == 'n')
-        {
-          txt++;
-          if (last != -1 || underline || bold)
-          {  
-            underline = FALSE;
-            bold = FALSE;
-            output[iPtr++] =  27; output[iPtr++] = '[';
-            output[iPtr++] = '0'; output[iPtr++] = 'm';
-          }
+      chunk->next = NULL;
+      chunk->segment = NULL;
+      chunk->len = 0;
 
-          last = -1;
-        }
+      if (dsock->out_last)
+        dsock->out_last->next = chunk;
+      else
+        dsock->out_first = chunk;
+      dsock->out_last = chunk;
+    }
 
-        /* check for valid color tag and parse */
-        else
-        {
-          bool validTag = FALSE;
+    size = UMIN(length, OUTPUT_CHUNK - chunk->len);
+    memcpy(chunk->data + chunk->len, txt, size);
+    chunk->len += size;
+    txt += size;
+    length -= size;
+  }
+}
 
-          for (j = 0; ansiTable[j].cString[0] != '\0'; j++)
-          {
-            if (*txt == ansiTable[j].cTag)
-            {
-              validTag = TRUE;
-
-              /* we only add the color sequence if it's needed */
-              if (last != j)
-              {
-                bool cSequence = FALSE;
-
-                /* escape sequence */
-                output[iPtr++] = 27; output[iPtr++] = '[';
-
-                /* remember if a color change is needed */
-                if (last == -1 || last / 2 != j / 2)
-                  cSequence = TRUE;
-
-                /* handle font boldness */
-                if (bold && ansiTable[j].aFlag == eTHIN)
-                {
-                  output[iPtr++] = '0';
-                  bold = FALSE;
-
-                  if (underline)
-                  {
-                    output[iPtr++] = ';'; output[iPtr++] = '4';
-                  }
-
-                  /* changing to eTHIN wipes the old color */
-                  output[iPtr++] = ';';
-                  cSequence = TRUE;
-                }
-                else if (!bold && ansiTable[j].aFlag == eBOLD)
-                {
-                  output[iPtr++] = '1';
-                  bold = TRUE;
-
-                  if (cSequence)
-                    output[iPtr++] = ';';
-                }
-
-                /* add color sequence if needed */
-                if (cSequence)
-                {
-                  for (k = 0; ansiTable[j].cString[k] != '\0'; k++)
-                  {
-                    output[iPtr++] = ansiTable[j].cString[k];
-                  }
-                }
-
-                output[iPtr++] = 'm';
-              }
-
-              /* remember the last color */
-              last = j;
-            }
-          }
+/*
+ * Link_to_buffer()
+ *
+ * Appends a shared segment to the socket's output queue,
+ * without copying it. The queue holds a reference to the
+ * segment untill the output is sent. If the segment does
+ * not fit, output_to_buffer() copies the part that does.
+ */
+bool link_to_buffer(D_SOCKET *dsock, SEGMENT *seg)
+{
+  OUT_CHUNK *chunk;
 
-          /* it wasn't a valid color tag */
-          if (!validTag)
-            output[iPtr++] = '#';
-          else
-            txt++;
-        }
-        break;   
+  if (dsock->out_overflow || dsock->top_output + seg->length > max_output)
+    return output_to_buffer(dsock, seg->data, seg->length);
+
+  /* these chunks have no data, so they are much smaller */
+  if (StackSize(link_free) <= 0)
+  {
+    if ((chunk = malloc(offsetof(OUT_CHUNK, data))) == NULL)
+    {
+      bug("Link_to_buffer: Cannot allocate memory.");
+      abort();
     }
   }
+  else
+  {
+    chunk = (OUT_CHUNK *) PopStack(link_free);
+  }
 
-  /* and terminate it with the standard color */
-  if (last != -1 || underline || bold)
+  __atomic_add_fetch(&seg->refs, 1, __ATOMIC_RELAXED);
+  chunk->next = NULL;
+  chunk->segment = seg;
+  chunk->len = seg->length;
+
+  if (dsock->out_last)
+    dsock->out_last->next = chunk;
+  else
+    dsock->out_first = chunk;
+  dsock->out_last = chunk;
+  dsock->top_output += seg->length;
+
+  return TRUE;
+}
+
+/* puts a chunk back on its free list */
+void free_chunk(OUT_CHUNK *chunk)
+{
+  if (chunk->segment)
   {
-    output[iPtr++] =  27; output[iPtr++] = '[';
-    output[iPtr++] = '0'; output[iPtr++] = 'm';
+    free_segment(chunk->segment);
+    PushStack(chunk, link_free);
   }
-  output[iPtr] = '\0';
+  else
+  {
+    PushStack(chunk, output_free);
+  }
+}
 
-  /* check to see if the socket can accept that much data */
-  if (dsock->top_output + iPtr >= MAX_OUTPUT)
+/*
+ * Free_output()
+ *
+ * Empties the socket's output queue, and puts
+ * the chunks back on the free list.
+ */
+void free_output(D_SOCKET *dsock)
+{
+  OUT_CHUNK *chunk;
+
+  while ((chunk = dsock->out_first) != NULL)
   {
-    bug("Text_to_buffer: ouput overflow on %s.", dsock->hostname);
-    return;
+    dsock->out_first = chunk->next;
+    free_chunk(chunk);
   }
 
-  /* add data to buffer */
-  strcpy(dsock->outbuf + dsock->top_output, output);
-  dsock->top_output += iPtr;
+  dsock->out_last = NULL;
+  dsock->top_output = 0;
+  dsock->out_overflow = FALSE;
 }
 
 /*
@@ -767,80 +985,211 @@ void text_to_mobile(D_MOBILE *dMob, const char *txt)
   }
 }
 
-void next_cmd_from_buffer(D_SOCKET *dsock)
+/*
+ * Line_to_game()
+ *
+ * Called by the telnet parser when a line has ended. The
+ * line collected in inbuf is passed on to the game as one
+ * command. Returns FALSE if the game has too many of our
+ * commands waiting already.
+ */
+bool line_to_game(D_SOCKET *dsock)
 {
-  int size = 0, i = 0, j = 0, telopt = 0;
+  int length = dsock->in_len;
+
+  dsock->in_len = 0;
+
+  /* don't let a single socket flood the game */
+  if (__atomic_add_fetch(&dsock->cmd_backlog, 1, __ATOMIC_RELAXED) > MAX_INPUT_BACKLOG)
+  {
+    write_to_socket(dsock, input_overflow, sizeof(input_overflow) - 1);
+    return FALSE;
+  }
+
+  /* and hand it to the game */
+  net_post_game(dsock, NET_MSG_INPUT, dsock->inbuf, length);
+
+  return TRUE;
+}
+
+/*
+ * Next_cmd_from_queue()
+ *
+ * Moves the oldest command the network thread has
+ * passed us into next_command, if there is room.
+ */
+void next_cmd_from_queue(D_SOCKET *dsock)
+{
+  NET_MSG *msg;
 
   /* if theres already a command ready, we return */
   if (dsock->next_command[0] != '\0')
     return;
 
   /* if there is nothing pending, then return */
-  if (dsock->inbuf[0] == '\0')
+  if ((msg = dsock->cmd_first) == NULL)
     return;
 
-  /* check how long the next command is */
-  while (dsock->inbuf[size] != '\0' && dsock->inbuf[size] != '\n' && dsock->inbuf[size] != '\r')
-    size++;
+  if ((dsock->cmd_first = msg->next) == NULL)
+    dsock->cmd_last = NULL;
 
-  /* we only deal with real commands */
-  if (dsock->inbuf[size] == '\0')
-    return;
+  strncpy(dsock->next_command, msg->data, MAX_BUFFER - 1);
+  dsock->next_command[MAX_BUFFER - 1] = '\0';
+  dsock->bust_prompt = TRUE;
 
-  /* copy the next command into next_command */
-  for ( ; i < size; i++)
+  __atomic_sub_fetch(&dsock->cmd_backlog, 1, __ATOMIC_RELAXED);
+  free_net_msg(msg);
+}
+
+/*
+ * Handle_cmd_queues()
+ *
+ * Handles the commands waiting on the sockets. We go round the
+ * socket list taking one command from each socket at a time, so
+ * a socket with a long queue cannot starve the others. Each
+ * socket gets at most CMDS_PER_PASS commands, and once every
+ * socket has had one, we stop when the commands have used more
+ * than CMD_PASS_USECS of cpu time. The rest waits for the
+ * next pass of the game loop. Returns TRUE if any commands
+ * are still waiting.
+ */
+bool handle_cmd_queues()
+{
+  D_SOCKET *dsock;
+  ITERATOR Iter;
+  struct timespec start, now;
+  bool more = TRUE, waiting = FALSE;
+  long usecs;
+  int round;
+
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+
+  for (round = 0; round < CMDS_PER_PASS && more; round++)
   {
-    if (dsock->inbuf[i] == (signed char) IAC)
-    {
-      telopt = 1;
-    }
-    else if (telopt == 1 && (dsock->inbuf[i] == (signed char) DO || dsock->inbuf[i] == (signed char) DONT))
-    {
-      telopt = 2;
-    }
-    else if (telopt == 2)
+    more = FALSE;
+
+    AttachIterator(&Iter, dsock_list);
+    while ((dsock = (D_SOCKET *) NextInList(&Iter)) != NULL)
     {
-      telopt = 0;
+      /* closed sockets are waiting to be recycled */
+      if (dsock->state == STATE_CLOSED) continue;
+
+      /* Ok, check for a new command */
+      next_cmd_from_queue(dsock);
 
-      if (dsock->inbuf[i] == (signed char) TELOPT_COMPRESS)         /* check for version 1 */
+      /*
+       * Is there a new command pending ? An empty line leaves us
+       * nothing to handle, but there may be more lines behind it.
+       */
+      if (dsock->next_command[0] == '\0')
       {
-        if (dsock->inbuf[i-1] == (signed char) DO)                  /* start compressing   */
-          compressStart(dsock, TELOPT_COMPRESS);
-        else if (dsock->inbuf[i-1] == (signed char) DONT)           /* stop compressing    */
-          compressEnd(dsock, TELOPT_COMPRESS, FALSE);
+        if (dsock->cmd_first != NULL)
+          more = TRUE;
+        continue;
       }
-      else if (dsock->inbuf[i] == (signed char) TELOPT_COMPRESS2)   /* check for version 2 */
+
+      /* figure out how to deal with the incoming command */
+      switch(dsock->state)
       {
-        if (dsock->inbuf[i-1] == (signed char) DO)                  /* start compressing   */
-          compressStart(dsock, TELOPT_COMPRESS2);
-        else if (dsock->inbuf[i-1] == (signed char) DONT)           /* stop compressing    */
-          compressEnd(dsock, TELOPT_COMPRESS2, FALSE);
+        default:
+          bug("Descriptor in bad state.");
+          break;
+        case STATE_NEW_NAME:
+        case STATE_NEW_PASSWORD:
+        case STATE_VERIFY_PASSWORD:
+        case STATE_ASK_PASSWORD:
+          handle_new_connections(dsock, dsock->next_command);
+          break;
+        case STATE_PLAYING:
+          handle_cmd_input(dsock, dsock->next_command);
+          break;
+      }
+
+      dsock->next_command[0] = '\0';
+
+      if (dsock->cmd_first != NULL)
+        more = TRUE;
+
+      /* everyone has had a command, check if we have time for more */
+      if (round > 0)
+      {
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+        usecs = (now.tv_sec - start.tv_sec) * 1000000 + (now.tv_nsec - start.tv_nsec) / 1000;
+        if (usecs >= CMD_PASS_USECS)
+        {
+          waiting = TRUE;
+          more = FALSE;
+          break;
+        }
       }
     }
-    else if (isprint(dsock->inbuf[i]) && isascii(dsock->inbuf[i]))
-    {
-      dsock->next_command[j++] = dsock->inbuf[i];
-    }
-  }
-  dsock->next_command[j] = '\0';
+    DetachIterator(&Iter);
 
-  /* skip forward to the next line */
-  while (dsock->inbuf[size] == '\n' || dsock->inbuf[size] == '\r')
-  {
-    dsock->bust_prompt = TRUE;   /* seems like a good place to check */
-    size++;
+    /* we ran out of rounds */
+    if (more && round == CMDS_PER_PASS - 1)
+      waiting = TRUE;
   }
 
-  /* use i as a static pointer */
-  i = size;
+  return waiting;
+}
+
+/*
+ * Handle_net_messages()
+ *
+ * Handles everything the network threads have passed
+ * on to the game since the last time we checked.
+ */
+void handle_net_messages()
+{
+  NET_MSG *msg;
+  D_SOCKET *dsock;
+  int backlog;
 
-  /* move the context of inbuf down */
-  while (dsock->inbuf[size] != '\0')
+  while ((msg = net_game_pop()) != NULL)
   {
-    dsock->inbuf[size - i] = dsock->inbuf[size];
-    size++;
+    dsock = msg->dsock;
+
+    switch(msg->type)
+    {
+      default:
+        bug("Handle_net_messages: bad message type %d.", msg->type);
+        break;
+      case NET_MSG_INPUT:
+        if (dsock->state == STATE_CLOSED)
+          break;
+
+        /* queue the command, it is handled in the game loop */
+        msg->next = NULL;
+        if (dsock->cmd_last)
+          dsock->cmd_last->next = msg;
+        else
+          dsock->cmd_first = msg;
+        dsock->cmd_last = msg;
+
+        /* remember the worst backlog, so we can see who is queueing */
+        backlog = __atomic_load_n(&dsock->cmd_backlog, __ATOMIC_RELAXED);
+        if (backlog > dsock->cmd_peak)
+          dsock->cmd_peak = backlog;
+        continue;
+      case NET_MSG_HANGUP:
+        close_socket(dsock, FALSE);
+        break;
+      case NET_MSG_CLOSED:
+        dsock->released = TRUE;
+        break;
+      case NET_MSG_LOG:
+        log_string("%s", msg->data);
+        break;
+      case NET_MSG_BUG:
+        bug("%s", msg->data);
+        break;
+      case NET_MSG_RESOLVED:
+        dns_resolved(dsock, (msg->length > 0) ? msg->data : NULL);
+        break;
+    }
+
+    free_net_msg(msg);
   }
-  dsock->inbuf[size - i] = '\0';
 }
 
 bool flush_output(D_SOCKET *dsock)
@@ -852,24 +1201,67 @@ bool flush_output(D_SOCKET *dsock)
   /* bust a prompt */
   if (dsock->state == STATE_PLAYING && dsock->bust_prompt)
   {
-    text_to_buffer(dsock, "\n\rSocketMud:> ");
+    template_to_buffer(dsock, &prompt_tpl, "\n\rSocketMud:> ");
     dsock->bust_prompt = FALSE;
   }
 
-  /* reset the top pointer */
-  dsock->top_output = 0;
-
   /*
-   * Send the buffer, and return FALSE
-   * if the write fails.
+   * A slow client still has lots of output waiting in the
+   * network thread, so we hold on to the new output until
+   * it has caught up. MAX_SEND_QUEUE only limits the bytes
+   * already handed to the network thread, the output held
+   * here is limited by max_output. If that overflows as
+   * well, the client is not reading at all, and we close
+   * the socket rather than throw away more of it's output.
    */
-  if (!text_to_socket(dsock, dsock->outbuf))
+  if (__atomic_load_n(&dsock->send_depth, __ATOMIC_RELAXED) > MAX_SEND_QUEUE)
+  {
+    if (!dsock->out_overflow)
+      return TRUE;
+
+    log_string("Flush_output: %s is not reading it's output.", dsock->hostname);
+    send_output(dsock);
     return FALSE;
+  }
+
+  /* send the queue */
+  send_output(dsock);
 
   /* Success */
   return TRUE;
 }
 
+/*
+ * Send_queue_depth()
+ *
+ * Returns how many bytes of output the socket holds,
+ * which the client has not received yet. This includes
+ * output queued in the game, and output waiting in the
+ * network thread for the client to read what we sent.
+ */
+int send_queue_depth(D_SOCKET *dsock)
+{
+  return dsock->top_output + __atomic_load_n(&dsock->send_depth, __ATOMIC_RELAXED);
+}
+
+/*
+ * Send_output()
+ *
+ * Hands everything in the output queue to the network
+ * thread, and puts the chunks back on the free list. Shared
+ * segments are passed on as they are, and the text between
+ * them in one message each. The thread writes it all with a
+ * single writev().
+ */
+void send_output(D_SOCKET *dsock)
+{
+  if (dsock->top_output <= 0)
+    return;
+
+  net_post_output(dsock, dsock->out_first, dsock->top_output);
+  free_output(dsock);
+}
+
 void handle_new_connections(D_SOCKET *dsock, char *arg)
 {
   D_MOBILE *p_new;
@@ -964,7 +1356,7 @@ void handle_new_connections(D_SOCKET *dsock, char *arg)
 
         /* and into the game */
         dsock->state = STATE_PLAYING;
-        text_to_buffer(dsock, motd);
+        template_to_buffer(dsock, &motd_tpl, motd);
 
         /* initialize events on the player */
         init_events_player(dsock->player);
@@ -1022,7 +1414,7 @@ void handle_new_connections(D_SOCKET *dsock, char *arg)
 
           /* and let him enter the game */
           dsock->state = STATE_PLAYING;
-          text_to_buffer(dsock, motd);
+          template_to_buffer(dsock, &motd_tpl, motd);
 
 	  /* initialize events on the player */
 	  init_events_player(dsock->player);
@@ -1051,42 +1443,13 @@ void clear_socket(D_SOCKET *sock_new, int sock)
   sock_new->lookup_status  =  TSTATE_LOOKUP;
   sock_new->player         =  NULL;
   sock_new->top_output     =  0;
-  sock_new->events         =  AllocList();
-}
-
-/* does the lookup, changes the hostname, and dies */
-void *lookup_address(void *arg)
-{
-  LOOKUP_DATA *lData = (LOOKUP_DATA *) arg;
-  struct hostent *from = 0;
-  struct hostent ent;
-  char buf[16384];
-  int err;
-
-  /* do the lookup and store the result at &from */
-  gethostbyaddr_r(lData->buf, sizeof(lData->buf), AF_INET, &ent, buf, 16384, &from, &err);
-
-  /* did we get anything ? */
-  if (from && from->h_name)
-  {
-    free(lData->dsock->hostname);
-    lData->dsock->hostname = strdup(from->h_name);
-  }
-
-  /* set it ready to be closed or used */
-  lData->dsock->lookup_status++;
-
-  /* free the lookup data */
-  free(lData->buf);
-  free(lData);
-
-  /* and kill the thread */
-  pthread_exit(0);
+  sock_new->events         =  NULL;
 }
 
 void recycle_sockets()
 {
   D_SOCKET *dsock;
+  NET_MSG *msg;
   ITERATOR Iter;
 
   AttachIterator(&Iter, dsock_list);
@@ -1094,6 +1457,9 @@ void recycle_sockets()
   {
     if (dsock->lookup_status != TSTATE_CLOSED) continue;
 
+    /* the network thread may still be using the socket */
+    if (!dsock->released) continue;
+
     /* remove the socket from the socket list */
     DetachFromList(dsock, dsock_list);
 
@@ -1103,11 +1469,15 @@ void recycle_sockets()
     /* free the memory */
     free(dsock->hostname);
 
-    /* free the list of events */
-    FreeList(dsock->events);
+    /* free any output we never got around to */
+    free_output(dsock);
 
-    /* stop compression */
-    compressEnd(dsock, dsock->compressing, TRUE);
+    /* free any commands we never got around to */
+    while ((msg = dsock->cmd_first) != NULL)
+    {
+      dsock->cmd_first = msg->next;
+      free_net_msg(msg);
+    }
 
     /* put the socket in the free stack */
     PushStack(dsock, dsock_free);
@@ -0,0 +1,186 @@
+/*
+ * This file contains the telnet parser. It runs on every byte
+ * as soon as it has been read, so option negotiation is handled
+ * at once, even when it arrives without a line of text, and
+ * telnet sequences may be split over any number of reads. Only
+ * clean line data is collected into the socket's input line.
+ */
+
+#include <sys/types.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+
+/* including main header file */
+#include "mud.h"
+
+/* local procedures */
+void      telnet_option         ( D_SOCKET *dsock, unsigned char verb, unsigned char option );
+void      telnet_subneg         ( D_SOCKET *dsock );
+
+/*
+ * Telnet_parse()
+ *
+ * Feeds input to the socket's telnet parser. Each complete
+ * line is passed on to the game. Returns FALSE if the socket
+ * should be closed, either because the line gets too long,
+ * or because too many commands are waiting already.
+ */
+bool telnet_parse(D_SOCKET *dsock, const char *data, int length)
+{
+  unsigned char c;
+  int i, span;
+
+  for (i = 0; i < length; i++)
+  {
+    /* copy any plain text in one go */
+    if (dsock->telnet_state == TELNET_DATA && (span = scan_text(data + i, length - i)) > 0)
+    {
+      if (dsock->in_len + span >= MAX_INBUF)
+      {
+        write_to_socket(dsock, input_overflow, strlen(input_overflow));
+        return FALSE;
+      }
+      memcpy(dsock->inbuf + dsock->in_len, data + i, span);
+      dsock->in_len += span;
+
+      if ((i += span) == length)
+        break;
+    }
+
+    c = (unsigned char) data[i];
+
+    switch(dsock->telnet_state)
+    {
+      default:
+        bug("Telnet_parse: bad state %d.", dsock->telnet_state);
+        dsock->telnet_state = TELNET_DATA;
+        break;
+
+      /* a CR LF, LF CR or CR NUL pair only ends one line */
+      case TELNET_CR:
+      case TELNET_LF:
+        if ((dsock->telnet_state == TELNET_CR && (c == '\n' || c == '\0')) ||
+            (dsock->telnet_state == TELNET_LF && c == '\r'))
+        {
+          dsock->telnet_state = TELNET_DATA;
+          break;
+        }
+        dsock->telnet_state = TELNET_DATA;
+        /* fall through */
+
+      case TELNET_DATA:
+        if (c == IAC)
+          dsock->telnet_state = TELNET_IAC;
+        else if (c == '\r' || c == '\n')
+        {
+          dsock->telnet_state = (c == '\r') ? TELNET_CR : TELNET_LF;
+          if (!line_to_game(dsock))
+            return FALSE;
+        }
+        else if (isascii(c) && isprint(c))
+        {
+          if (dsock->in_len >= MAX_INBUF - 1)
+          {
+            write_to_socket(dsock, input_overflow, strlen(input_overflow));
+            return FALSE;
+          }
+          dsock->inbuf[dsock->in_len++] = c;
+        }
+        break;
+
+      case TELNET_IAC:
+        switch(c)
+        {
+          case WILL:
+          case WONT:
+          case DO:
+          case DONT:
+            dsock->telnet_verb = c;
+            dsock->telnet_state = TELNET_OPT;
+            break;
+          case SB:
+            dsock->telnet_state = TELNET_SB;
+            break;
+          default:     /* IAC IAC and the other commands mean nothing to us */
+            dsock->telnet_state = TELNET_DATA;
+            break;
+        }
+        break;
+
+      case TELNET_OPT:
+        telnet_option(dsock, dsock->telnet_verb, c);
+        dsock->telnet_state = TELNET_DATA;
+        break;
+
+      case TELNET_SB:
+        dsock->sb_option = c;
+        dsock->sb_len = 0;
+        dsock->telnet_state = TELNET_SB_DATA;
+        break;
+
+      case TELNET_SB_DATA:
+        if (c == IAC)
+          dsock->telnet_state = TELNET_SB_IAC;
+        else if (dsock->sb_len < TELNET_SB_MAX)
+          dsock->sb_data[dsock->sb_len++] = c;
+        break;
+
+      case TELNET_SB_IAC:
+        if (c == IAC)          /* an escaped 255 in the data */
+        {
+          if (dsock->sb_len < TELNET_SB_MAX)
+            dsock->sb_data[dsock->sb_len++] = c;
+          dsock->telnet_state = TELNET_SB_DATA;
+        }
+        else                   /* IAC SE, or a broken subnegotiation */
+        {
+          if (c == SE)
+            telnet_subneg(dsock);
+          dsock->telnet_state = TELNET_DATA;
+        }
+        break;
+    }
+  }
+
+  return TRUE;
+}
+
+/*
+ * Telnet_option()
+ *
+ * Handles an IAC WILL/WONT/DO/DONT from the client. We never
+ * refuse other options, since the client's answer to our
+ * echo negotiation ends up here as well.
+ */
+void telnet_option(D_SOCKET *dsock, unsigned char verb, unsigned char option)
+{
+  switch(option)
+  {
+    default:
+      break;
+    case TELOPT_COMPRESS:                       /* version 1 */
+    case TELOPT_COMPRESS2:                      /* version 2 */
+      if (verb == DO)                           /* start compressing */
+        compressStart(dsock, option);
+      else if (verb == DONT)                    /* stop compressing  */
+        compressEnd(dsock, option, FALSE);
+      break;
+  }
+}
+
+/*
+ * Telnet_subneg()
+ *
+ * Handles a complete IAC SB <option> ... IAC SE from the client,
+ * the data is in sb_data. None of the options we offer use
+ * subnegotiation, so for now they are only parsed and dropped.
+ */
+void telnet_subneg(D_SOCKET *dsock)
+{
+  switch(dsock->sb_option)
+  {
+    default:
+      break;
+  }
+}
@@ -0,0 +1,192 @@
+/*
+ * This file contains the message templates. A template holds the
+ * final bytes of a static or rarely changing message, with all
+ * the color tags already rendered, so sending it is a single copy
+ * into the output queue. A template is rendered the first time it
+ * is sent, and stays that way untill template_clear() is called,
+ * which should be done whenever the text behind it changes.
+ *
+ * Segments are rendered messages which are sent to many sockets
+ * at once. Each socket's output queue refers to the segment
+ * instead of copying it, and the segment is freed when the last
+ * socket is done with it, which may happen in a network thread.
+ */
+
+#include <sys/types.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+/* including main header file */
+#include "mud.h"
+
+/* local procedures */
+bool      render_to_template    ( void *arg, const char *txt, int length );
+
+/*
+ * Template_compile()
+ *
+ * Renders the text into the template, replacing whatever
+ * the template held before.
+ */
+void template_compile(TEMPLATE *tpl, const char *txt)
+{
+  template_clear(tpl);
+
+  render_ansi(txt, strlen(txt), &render_to_template, tpl);
+
+  /* an empty text still needs something to point at */
+  if (tpl->data == NULL && (tpl->data = malloc(1)) == NULL)
+  {
+    bug("Template_compile: Cannot allocate memory.");
+    abort();
+  }
+}
+
+/* the renderer's output function for template_compile() */
+bool render_to_template(void *arg, const char *txt, int length)
+{
+  TEMPLATE *tpl = (TEMPLATE *) arg;
+  char *data;
+
+  if ((data = realloc(tpl->data, tpl->len + length)) == NULL)
+  {
+    bug("Render_to_template: Cannot allocate memory.");
+    abort();
+  }
+  memcpy(data + tpl->len, txt, length);
+  tpl->data = data;
+  tpl->len += length;
+
+  return TRUE;
+}
+
+/*
+ * Template_clear()
+ *
+ * Throws away the rendered text, so the template
+ * is rendered again the next time it is sent.
+ */
+void template_clear(TEMPLATE *tpl)
+{
+  free(tpl->data);
+  tpl->data = NULL;
+  tpl->len = 0;
+}
+
+/*
+ * Template_to_buffer()
+ *
+ * Works like text_to_buffer(), but sends the template,
+ * which is rendered from txt first if it is not ready.
+ * The text may be NULL if the template is known to be
+ * ready already.
+ */
+void template_to_buffer(D_SOCKET *dsock, TEMPLATE *tpl, const char *txt)
+{
+  if (tpl->data == NULL)
+  {
+    if (txt == NULL)
+    {
+      bug("Template_to_buffer: no text for empty template.");
+      return;
+    }
+    template_compile(tpl, txt);
+  }
+
+  /* always start with a leading space */
+  if (dsock->top_output == 0 && !output_to_buffer(dsock, "\n\r", 2))
+    return;
+
+  output_to_buffer(dsock, tpl->data, tpl->len);
+}
+
+/*
+ * Template_to_mobile()
+ *
+ * Works like text_to_mobile(), but sends a template.
+ */
+void template_to_mobile(D_MOBILE *dMob, TEMPLATE *tpl, const char *txt)
+{
+  if (dMob->socket)
+  {
+    template_to_buffer(dMob->socket, tpl, txt);
+    dMob->socket->bust_prompt = TRUE;
+  }
+}
+
+/*
+ * Render_segment()
+ *
+ * Renders the text into a new segment, which is held by the
+ * caller until it calls free_segment().
+ */
+SEGMENT *render_segment(const char *txt)
+{
+  TEMPLATE tpl = { NULL, 0 };
+  SEGMENT *seg;
+
+  if ((seg = malloc(sizeof(*seg))) == NULL)
+  {
+    bug("Render_segment: Cannot allocate memory.");
+    abort();
+  }
+
+  /* the segment takes over the rendered text, ending it with a NUL */
+  template_compile(&tpl, txt);
+  render_to_template(&tpl, "", 1);
+
+  seg->refs   = 1;
+  seg->length = tpl.len - 1;
+  seg->data   = tpl.data;
+
+  return seg;
+}
+
+/*
+ * Free_segment()
+ *
+ * Drops a reference to the segment, and frees it if that
+ * was the last one. Any thread may do this.
+ */
+void free_segment(SEGMENT *seg)
+{
+  if (__atomic_sub_fetch(&seg->refs, 1, __ATOMIC_ACQ_REL) > 0)
+    return;
+
+  free(seg->data);
+  free(seg);
+}
+
+/*
+ * Segment_to_buffer()
+ *
+ * Works like text_to_buffer(), but sends a segment. Short
+ * segments are simply copied, since that is cheaper than
+ * sending them on their own.
+ */
+void segment_to_buffer(D_SOCKET *dsock, SEGMENT *seg)
+{
+  /* always start with a leading space */
+  if (dsock->top_output == 0 && !output_to_buffer(dsock, "\n\r", 2))
+    return;
+
+  if (seg->length <= SEGMENT_COPY_MAX)
+    output_to_buffer(dsock, seg->data, seg->length);
+  else
+    link_to_buffer(dsock, seg);
+}
+
+/*
+ * Segment_to_mobile()
+ *
+ * Works like text_to_mobile(), but sends a segment.
+ */
+void segment_to_mobile(D_MOBILE *dMob, SEGMENT *seg)
+{
+  if (dMob->socket)
+  {
+    segment_to_buffer(dMob->socket, seg);
+    dMob->socket->bust_prompt = TRUE;
+  }
+}
@@ -0,0 +1,1004 @@
+/*
+ * This file contains the io_uring backend for the reactor.
+ *
+ * Connections are accepted with a multishot accept, input is
+ * received with a multishot recv into a ring of provided buffers,
+ * and output is queued per socket and sent with one send in
+ * flight at a time. Everything queued during a pulse is handed
+ * to the kernel with a single io_uring_enter() call.
+ *
+ * We talk to the kernel directly, so no liburing is needed.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/utsname.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+/* including main header file */
+#include "mud.h"
+
+/* the operation is stored in the low bits of the user_data */
+#define URING_OP_ACCEPT        1
+#define URING_OP_RECV          2
+#define URING_OP_SEND          3
+#define URING_OP_WAKE          4
+#define URING_OP_TIMER         5
+#define URING_OP_MASK          7
+
+/* the provided buffer group used for all input */
+#define URING_BGID             0
+
+typedef struct uring_conn URING_CONN;
+
+/* the kernel side state of one socket */
+struct uring_conn
+{
+  D_SOCKET         * dsock;            /* NULL once the socket is removed     */
+  int                fd;               /* the descriptor we do io on          */
+  int                inflight;         /* operations the kernel still holds   */
+  bool               recv_armed;       /* the multishot recv is active        */
+  bool               sending;          /* a send is in flight                 */
+  bool               waiting;          /* on the ring's list of sockets to    */
+  URING_CONN       * next_waiting;     /* start again on the next poll        */
+  char             * send_buf;         /* the data being sent                 */
+  int                send_len;         /* how much data is in send_buf        */
+  int                send_off;         /* how much of it has been sent        */
+  int                send_size;        /* the allocated size of send_buf      */
+  char             * queue_buf;        /* data waiting for the current send   */
+  int                queue_len;        /* how much data is in queue_buf       */
+  int                queue_size;       /* the allocated size of queue_buf     */
+};
+
+/* the ring and everything mapped from it */
+struct uring_data
+{
+  int                ring_fd;          /* the io_uring descriptor             */
+  int                listeners[REACTOR_LISTENERS];  /* sockets accepting connections */
+  bool               accept_armed[REACTOR_LISTENERS];  /* their multishot accepts  */
+  int                listener_count;
+  int                wake_fd;          /* the reactor's wakeup eventfd        */
+  bool               wake_armed;       /* the multishot poll on it is active  */
+  int                timer_fd;         /* the reactor's timerfd, or -1        */
+  bool               timer_armed;      /* the multishot poll on it is active  */
+  bool               ext_arg;          /* the kernel supports timed waits     */
+
+  unsigned         * sq_head;          /* submission queue                    */
+  unsigned         * sq_tail;
+  unsigned         * sq_mask;
+  unsigned         * sq_flags;
+  unsigned         * sq_array;
+  unsigned           sq_entries;
+  unsigned           sq_local_tail;    /* entries prepared but not published  */
+  struct io_uring_sqe * sqes;
+
+  unsigned         * cq_head;          /* completion queue                    */
+  unsigned         * cq_tail;
+  unsigned         * cq_mask;
+  struct io_uring_cqe * cqes;
+
+  struct io_uring_buf_ring * buf_ring; /* the provided input buffers          */
+  char             * buf_base;
+  unsigned           buf_tail;
+
+  URING_CONN      ** conns;            /* maps a descriptor to it's state     */
+  int                conns_size;
+  URING_CONN       * waiting;          /* sockets to start again on next poll */
+};
+
+/* local procedures */
+bool  uring_kernel_ok          ( void );
+bool  uring_map                ( URING *ring, struct io_uring_params *p );
+bool  uring_setup_buffers      ( URING *ring );
+struct io_uring_sqe *uring_get_sqe ( URING *ring );
+int   uring_enter              ( URING *ring, unsigned submit, unsigned wait, unsigned flags, int timeout );
+void  uring_recycle_buffer     ( URING *ring, int bid );
+void  uring_arm_accept         ( URING *ring, int index );
+void  uring_arm_wake           ( URING *ring );
+void  uring_arm_timer          ( URING *ring );
+void  uring_arm_recv           ( URING *ring, URING_CONN *conn );
+void  uring_start_send         ( URING *ring, URING_CONN *conn );
+void  uring_wait               ( URING *ring, URING_CONN *conn );
+void  uring_restart            ( URING *ring );
+void  uring_release            ( URING *ring, URING_CONN *conn );
+void  uring_handle_accept      ( URING *ring, int index, int res, unsigned flags );
+void  uring_handle_wake        ( URING *ring, unsigned flags );
+void  uring_handle_timer       ( URING *ring, unsigned flags );
+void  uring_handle_recv        ( URING *ring, URING_CONN *conn, int res, unsigned flags );
+void  uring_handle_send        ( URING *ring, URING_CONN *conn, int res );
+void  uring_reap               ( URING *ring );
+
+/*
+ * Uring_kernel_ok()
+ *
+ * Multishot recv needs at least a 6.0 kernel, and older
+ * kernels do not tell us until the first read fails, so
+ * we check the version up front.
+ */
+bool uring_kernel_ok()
+{
+  struct utsname uts;
+  int major = 0, minor = 0;
+
+  if (uname(&uts) < 0)
+    return FALSE;
+
+  if (sscanf(uts.release, "%d.%d", &major, &minor) != 2)
+    return FALSE;
+
+  if (major != URING_MIN_MAJOR)
+    return (major > URING_MIN_MAJOR);
+
+  return (minor >= URING_MIN_MINOR);
+}
+
+/*
+ * Init_uring()
+ *
+ * Sets up a ring, listening for wakeups on wake_fd. Returns
+ * NULL if the kernel lacks support for any of the features we
+ * need, in which case the caller should fall back to epoll.
+ */
+URING *init_uring(int wake_fd)
+{
+  struct io_uring_params p;
+  URING *ring;
+  int fd;
+
+  if (!uring_kernel_ok())
+  {
+    log_string("Init_uring: kernel is too old for io_uring.");
+    return NULL;
+  }
+
+  memset(&p, 0, sizeof(p));
+  p.flags = IORING_SETUP_CQSIZE;
+  p.cq_entries = URING_ENTRIES * 4;
+
+  if ((fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p)) < 0)
+  {
+    log_string("Init_uring: io_uring_setup failed (%s).", strerror(errno));
+    return NULL;
+  }
+
+  if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_NODROP))
+  {
+    log_string("Init_uring: kernel lacks required io_uring features.");
+    close(fd);
+    return NULL;
+  }
+
+  if ((ring = calloc(1, sizeof(*ring))) == NULL)
+  {
+    bug("Init_uring: Cannot allocate memory.");
+    abort();
+  }
+
+  ring->ring_fd  = fd;
+  ring->wake_fd  = wake_fd;
+  ring->timer_fd = -1;
+  ring->ext_arg  = (p.features & IORING_FEAT_EXT_ARG) ? TRUE : FALSE;
+
+  if (!uring_map(ring, &p) || !uring_setup_buffers(ring))
+  {
+    close(fd);
+    free(ring);
+    return NULL;
+  }
+
+  /* start listening for wakeups */
+  uring_arm_wake(ring);
+
+  return ring;
+}
+
+/*
+ * Uring_map()
+ *
+ * Maps the submission and completion queues into memory.
+ */
+bool uring_map(URING *ring, struct io_uring_params *p)
+{
+  size_t sq_size, cq_size;
+  char *sq_ptr, *sqes;
+
+  sq_size = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+  cq_size = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+  if (cq_size > sq_size)
+    sq_size = cq_size;
+
+  /* with IORING_FEAT_SINGLE_MMAP both queues share one mapping */
+  sq_ptr = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                ring->ring_fd, IORING_OFF_SQ_RING);
+  if (sq_ptr == MAP_FAILED)
+  {
+    log_string("Uring_map: cannot map the rings (%s).", strerror(errno));
+    return FALSE;
+  }
+
+  sqes = mmap(NULL, p->sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+              MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED)
+  {
+    log_string("Uring_map: cannot map the sqes (%s).", strerror(errno));
+    munmap(sq_ptr, sq_size);
+    return FALSE;
+  }
+
+  ring->sq_head       = (unsigned *) (sq_ptr + p->sq_off.head);
+  ring->sq_tail       = (unsigned *) (sq_ptr + p->sq_off.tail);
+  ring->sq_mask       = (unsigned *) (sq_ptr + p->sq_off.ring_mask);
+  ring->sq_flags      = (unsigned *) (sq_ptr + p->sq_off.flags);
+  ring->sq_array      = (unsigned *) (sq_ptr + p->sq_off.array);
+  ring->sq_entries    = p->sq_entries;
+  ring->sq_local_tail = *ring->sq_tail;
+  ring->sqes          = (struct io_uring_sqe *) sqes;
+
+  ring->cq_head       = (unsigned *) (sq_ptr + p->cq_off.head);
+  ring->cq_tail       = (unsigned *) (sq_ptr + p->cq_off.tail);
+  ring->cq_mask       = (unsigned *) (sq_ptr + p->cq_off.ring_mask);
+  ring->cqes          = (struct io_uring_cqe *) (sq_ptr + p->cq_off.cqes);
+
+  return TRUE;
+}
+
+/*
+ * Uring_setup_buffers()
+ *
+ * Registers a ring of provided buffers, which the kernel
+ * fills with input as it arrives on any socket.
+ */
+bool uring_setup_buffers(URING *ring)
+{
+  struct io_uring_buf_reg reg;
+  size_t size;
+  int i;
+
+  size = URING_BUFFERS * sizeof(struct io_uring_buf);
+  ring->buf_ring = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ring->buf_ring == MAP_FAILED)
+  {
+    log_string("Uring_setup_buffers: cannot map buffer ring (%s).", strerror(errno));
+    return FALSE;
+  }
+
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr    = (unsigned long) ring->buf_ring;
+  reg.ring_entries = URING_BUFFERS;
+  reg.bgid         = URING_BGID;
+
+  if (syscall(__NR_io_uring_register, ring->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+  {
+    log_string("Uring_setup_buffers: cannot register buffers (%s).", strerror(errno));
+    munmap(ring->buf_ring, size);
+    return FALSE;
+  }
+
+  if ((ring->buf_base = malloc(URING_BUFFERS * URING_BUFFER_SIZE)) == NULL)
+  {
+    bug("Uring_setup_buffers: Cannot allocate memory.");
+    abort();
+  }
+
+  ring->buf_tail = 0;
+  for (i = 0; i < URING_BUFFERS; i++)
+    uring_recycle_buffer(ring, i);
+
+  return TRUE;
+}
+
+/*
+ * Uring_recycle_buffer()
+ *
+ * Hands an input buffer back to the kernel.
+ */
+void uring_recycle_buffer(URING *ring, int bid)
+{
+  struct io_uring_buf *buf;
+
+  buf = &ring->buf_ring->bufs[ring->buf_tail & (URING_BUFFERS - 1)];
+  buf->addr = (unsigned long) (ring->buf_base + bid * URING_BUFFER_SIZE);
+  buf->len  = URING_BUFFER_SIZE;
+  buf->bid  = bid;
+
+  ring->buf_tail++;
+  __atomic_store_n(&ring->buf_ring->tail, (unsigned short) ring->buf_tail, __ATOMIC_RELEASE);
+}
+
+/*
+ * Uring_get_sqe()
+ *
+ * Returns a cleared submission entry, submitting the
+ * queue first if it is full. Returns NULL if the queue
+ * could not be submitted, in which case the caller must
+ * try again later.
+ */
+struct io_uring_sqe *uring_get_sqe(URING *ring)
+{
+  struct io_uring_sqe *sqe;
+  unsigned idx;
+
+  while (ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries)
+  {
+    if (uring_enter(ring, ring->sq_entries, 0, 0, 0) < 0 && errno != EINTR && errno != EBUSY)
+    {
+      perror("Uring_get_sqe");
+      return NULL;
+    }
+  }
+
+  idx = ring->sq_local_tail & *ring->sq_mask;
+  ring->sq_array[idx] = idx;
+  ring->sq_local_tail++;
+
+  sqe = &ring->sqes[idx];
+  memset(sqe, 0, sizeof(*sqe));
+
+  return sqe;
+}
+
+/*
+ * Uring_enter()
+ *
+ * Publishes all prepared entries, and calls io_uring_enter.
+ * If wait is set we block until that many completions have
+ * arrived, or timeout milliseconds have passed.
+ */
+int uring_enter(URING *ring, unsigned submit, unsigned wait, unsigned flags, int timeout)
+{
+  struct io_uring_getevents_arg arg;
+  struct __kernel_timespec ts;
+  void *argp = NULL;
+  size_t argsz = 0;
+
+  __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+
+  if (wait > 0)
+  {
+    flags |= IORING_ENTER_GETEVENTS;
+
+    if (timeout >= 0 && ring->ext_arg)
+    {
+      memset(&arg, 0, sizeof(arg));
+      ts.tv_sec  = timeout / 1000;
+      ts.tv_nsec = (timeout % 1000) * 1000000L;
+      arg.ts     = (unsigned long) &ts;
+      argp       = &arg;
+      argsz      = sizeof(arg);
+      flags     |= IORING_ENTER_EXT_ARG;
+    }
+    else if (timeout >= 0)
+      wait = 0;
+  }
+
+  return syscall(__NR_io_uring_enter, ring->ring_fd, submit, wait, flags, argp, argsz);
+}
+
+/*
+ * Uring_submit()
+ *
+ * Hands everything queued since the last call to the kernel.
+ */
+void uring_submit(URING *ring)
+{
+  unsigned pending;
+
+  pending = ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+  if (pending == 0)
+    return;
+
+  if (uring_enter(ring, pending, 0, 0, 0) < 0 && errno != EINTR && errno != EBUSY)
+    perror("Uring_submit");
+}
+
+/*
+ * Uring_add_listener()
+ *
+ * Starts accepting connections on a listening socket.
+ */
+bool uring_add_listener(URING *ring, int listener)
+{
+  if (ring->listener_count >= REACTOR_LISTENERS)
+    return FALSE;
+
+  ring->listeners[ring->listener_count] = listener;
+  uring_arm_accept(ring, ring->listener_count++);
+
+  return TRUE;
+}
+
+/*
+ * Uring_add_timer()
+ *
+ * Starts watching the reactor's timerfd, so the ring
+ * wakes up when the timer expires.
+ */
+void uring_add_timer(URING *ring, int timer_fd)
+{
+  ring->timer_fd = timer_fd;
+  uring_arm_timer(ring);
+}
+
+/*
+ * If we cannot get a submission entry, the accept, wake and
+ * timer polls are left unarmed, and uring_poll() arms them
+ * again. Sockets are put on the waiting list instead.
+ */
+
+/* the listener's index is kept above the operation bits */
+void uring_arm_accept(URING *ring, int index)
+{
+  struct io_uring_sqe *sqe;
+
+  if ((sqe = uring_get_sqe(ring)) == NULL)
+    return;
+
+  sqe->opcode       = IORING_OP_ACCEPT;
+  sqe->fd           = ring->listeners[index];
+  sqe->ioprio       = IORING_ACCEPT_MULTISHOT;
+  sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+  sqe->user_data    = ((unsigned long) index << 3) | URING_OP_ACCEPT;
+
+  ring->accept_armed[index] = TRUE;
+}
+
+void uring_arm_wake(URING *ring)
+{
+  struct io_uring_sqe *sqe;
+
+  if ((sqe = uring_get_sqe(ring)) == NULL)
+    return;
+
+  sqe->opcode        = IORING_OP_POLL_ADD;
+  sqe->fd            = ring->wake_fd;
+  sqe->poll32_events = POLLIN;
+  sqe->len           = IORING_POLL_ADD_MULTI;
+  sqe->user_data     = URING_OP_WAKE;
+
+  ring->wake_armed = TRUE;
+}
+
+void uring_arm_timer(URING *ring)
+{
+  struct io_uring_sqe *sqe;
+
+  if ((sqe = uring_get_sqe(ring)) == NULL)
+    return;
+
+  sqe->opcode        = IORING_OP_POLL_ADD;
+  sqe->fd            = ring->timer_fd;
+  sqe->poll32_events = POLLIN;
+  sqe->len           = IORING_POLL_ADD_MULTI;
+  sqe->user_data     = URING_OP_TIMER;
+
+  ring->timer_armed = TRUE;
+}
+
+void uring_arm_recv(URING *ring, URING_CONN *conn)
+{
+  struct io_uring_sqe *sqe;
+
+  if ((sqe = uring_get_sqe(ring)) == NULL)
+  {
+    uring_wait(ring, conn);
+    return;
+  }
+
+  sqe->opcode    = IORING_OP_RECV;
+  sqe->fd        = conn->fd;
+  sqe->ioprio    = IORING_RECV_MULTISHOT;
+  sqe->flags     = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = URING_BGID;
+  sqe->user_data = (unsigned long) conn | URING_OP_RECV;
+
+  conn->recv_armed = TRUE;
+  conn->inflight++;
+}
+
+/*
+ * Uring_start_send()
+ *
+ * Sends what is left of the send buffer, or if it has all
+ * been sent, moves the queued output into the send buffer,
+ * and starts sending that.
+ */
+void uring_start_send(URING *ring, URING_CONN *conn)
+{
+  struct io_uring_sqe *sqe;
+
+  if (conn->sending)
+    return;
+
+  if (conn->send_off >= conn->send_len)
+  {
+    char *buf;
+    int size;
+
+    if (conn->queue_len == 0)
+      return;
+
+    /* swap the buffers, so we never have to copy the data */
+    buf = conn->send_buf;
+    size = conn->send_size;
+    conn->send_buf = conn->queue_buf;
+    conn->send_size = conn->queue_size;
+    conn->send_len = conn->queue_len;
+    conn->send_off = 0;
+    conn->queue_buf = buf;
+    conn->queue_size = size;
+    conn->queue_len = 0;
+  }
+
+  if ((sqe = uring_get_sqe(ring)) == NULL)
+  {
+    uring_wait(ring, conn);
+    return;
+  }
+
+  sqe->opcode    = IORING_OP_SEND;
+  sqe->fd        = conn->fd;
+  sqe->addr      = (unsigned long) (conn->send_buf + conn->send_off);
+  sqe->len       = conn->send_len - conn->send_off;
+  sqe->msg_flags = MSG_NOSIGNAL;
+  sqe->user_data = (unsigned long) conn | URING_OP_SEND;
+
+  conn->sending = TRUE;
+  conn->inflight++;
+}
+
+/*
+ * Uring_wait()
+ *
+ * Puts a socket on the list of sockets whose recv or send
+ * could not be started, so uring_poll() tries again. The
+ * list holds on to the socket like an operation would.
+ */
+void uring_wait(URING *ring, URING_CONN *conn)
+{
+  if (conn->waiting)
+    return;
+
+  conn->waiting = TRUE;
+  conn->inflight++;
+  conn->next_waiting = ring->waiting;
+  ring->waiting = conn;
+}
+
+/*
+ * Uring_restart()
+ *
+ * Starts the recv and send of every waiting socket again,
+ * those which still cannot start go back on the list.
+ */
+void uring_restart(URING *ring)
+{
+  URING_CONN *conn, *conn_next;
+
+  conn = ring->waiting;
+  ring->waiting = NULL;
+
+  for ( ; conn != NULL; conn = conn_next)
+  {
+    conn_next = conn->next_waiting;
+    conn->waiting = FALSE;
+    conn->inflight--;
+
+    if (conn->dsock == NULL)
+    {
+      uring_release(ring, conn);
+      continue;
+    }
+
+    if (!conn->recv_armed)
+      uring_arm_recv(ring, conn);
+    uring_start_send(ring, conn);
+  }
+}
+
+/*
+ * Uring_add_socket()
+ *
+ * Starts receiving input on a socket.
+ */
+bool uring_add_socket(URING *ring, D_SOCKET *dsock)
+{
+  URING_CONN *conn;
+  int fd = dsock->control;
+
+  if (fd >= ring->conns_size)
+  {
+    URING_CONN **conns;
+    int size = (ring->conns_size > 0) ? ring->conns_size : REACTOR_TABLE_SIZE;
+
+    while (size <= fd)
+      size *= 2;
+
+    if ((conns = realloc(ring->conns, size * sizeof(*conns))) == NULL)
+    {
+      bug("Uring_add_socket: Cannot allocate memory for %d slots.", size);
+      return FALSE;
+    }
+    memset(conns + ring->conns_size, 0, (size - ring->conns_size) * sizeof(*conns));
+    ring->conns = conns;
+    ring->conns_size = size;
+  }
+
+  if ((conn = calloc(1, sizeof(*conn))) == NULL)
+  {
+    bug("Uring_add_socket: Cannot allocate memory.");
+    abort();
+  }
+
+  conn->dsock = dsock;
+  conn->fd = fd;
+  ring->conns[fd] = conn;
+
+  uring_arm_recv(ring, conn);
+
+  return TRUE;
+}
+
+/*
+ * Uring_del_socket()
+ *
+ * Detaches a socket, and cancels anything the kernel
+ * is still doing for it. The state is released once
+ * the last operation has completed.
+ */
+void uring_del_socket(URING *ring, D_SOCKET *dsock)
+{
+  struct io_uring_sqe *sqe;
+  URING_CONN *conn;
+  int fd = dsock->control;
+
+  if (fd < 0 || fd >= ring->conns_size || (conn = ring->conns[fd]) == NULL)
+    return;
+  if (conn->dsock != dsock)
+    return;
+
+  ring->conns[fd] = NULL;
+  conn->dsock = NULL;
+
+  /* without an entry, the recv ends when the descriptor is closed */
+  if (conn->inflight > 0 && (sqe = uring_get_sqe(ring)) != NULL)
+  {
+    sqe->opcode      = IORING_OP_ASYNC_CANCEL;
+    sqe->fd          = fd;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    sqe->user_data   = 0;
+  }
+
+  uring_release(ring, conn);
+}
+
+/*
+ * Uring_release()
+ *
+ * Frees the state of a detached socket, once the kernel
+ * no longer holds any of it's buffers.
+ */
+void uring_release(URING *ring, URING_CONN *conn)
+{
+  if (conn->dsock != NULL || conn->inflight > 0)
+    return;
+
+  free(conn->send_buf);
+  free(conn->queue_buf);
+  free(conn);
+}
+
+/*
+ * Uring_write()
+ *
+ * Queues output for a socket. The data is copied, and sent
+ * the next time the ring is submitted. Like a socket buffer,
+ * we hold no more than URING_SEND_MAX bytes for a socket, so
+ * this may take only part of the data, and fails with EAGAIN
+ * when there is no room at all.
+ */
+int uring_write(URING *ring, D_SOCKET *dsock, const char *txt, int length)
+{
+  URING_CONN *conn;
+  int fd = dsock->control, room;
+
+  if (fd < 0 || fd >= ring->conns_size || (conn = ring->conns[fd]) == NULL)
+  {
+    errno = EBADF;
+    return -1;
+  }
+
+  if ((room = URING_SEND_MAX - conn->queue_len - (conn->send_len - conn->send_off)) <= 0)
+  {
+    errno = EAGAIN;
+    return -1;
+  }
+  length = UMIN(length, room);
+
+  if (conn->queue_len + length > conn->queue_size)
+  {
+    char *buf;
+    int size = (conn->queue_size > 0) ? conn->queue_size : URING_BUFFER_SIZE;
+
+    while (size < conn->queue_len + length)
+      size *= 2;
+
+    if ((buf = realloc(conn->queue_buf, size)) == NULL)
+    {
+      bug("Uring_write: Cannot allocate memory.");
+      errno = ENOMEM;
+      return -1;
+    }
+    conn->queue_buf = buf;
+    conn->queue_size = size;
+  }
+
+  memcpy(conn->queue_buf + conn->queue_len, txt, length);
+  conn->queue_len += length;
+
+  uring_start_send(ring, conn);
+
+  return length;
+}
+
+void uring_handle_accept(URING *ring, int index, int res, unsigned flags)
+{
+  if (!(flags & IORING_CQE_F_MORE))
+    ring->accept_armed[index] = FALSE;
+
+  if (res >= 0)
+    new_socket(res);
+  else if (res != -EAGAIN && res != -ECANCELED && res != -EINTR)
+    log_string("Uring_handle_accept: %s", strerror(-res));
+}
+
+void uring_handle_wake(URING *ring, unsigned flags)
+{
+  uint64_t count;
+
+  if (!(flags & IORING_CQE_F_MORE))
+    ring->wake_armed = FALSE;
+
+  if (read(ring->wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+    perror("Uring_handle_wake: read");
+}
+
+void uring_handle_timer(URING *ring, unsigned flags)
+{
+  uint64_t count;
+
+  if (!(flags & IORING_CQE_F_MORE))
+    ring->timer_armed = FALSE;
+
+  if (read(ring->timer_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+    perror("Uring_handle_timer: read");
+}
+
+void uring_handle_recv(URING *ring, URING_CONN *conn, int res, unsigned flags)
+{
+  D_SOCKET *dsock = conn->dsock;
+  bool success = TRUE;
+
+  if (!(flags & IORING_CQE_F_MORE))
+  {
+    conn->recv_armed = FALSE;
+    conn->inflight--;
+  }
+
+  if (flags & IORING_CQE_F_BUFFER)
+  {
+    int bid = flags >> IORING_CQE_BUFFER_SHIFT;
+
+    if (res > 0 && dsock != NULL && !dsock->hangup)
+      success = telnet_parse(dsock, ring->buf_base + bid * URING_BUFFER_SIZE, res);
+
+    uring_recycle_buffer(ring, bid);
+  }
+
+  if (dsock == NULL)
+  {
+    uring_release(ring, conn);
+    return;
+  }
+
+  if (res == 0)
+  {
+    log_string("Read_from_socket: EOF");
+    success = FALSE;
+  }
+  else if (res < 0 && res != -ENOBUFS && res != -ECANCELED && res != -EINTR)
+  {
+    log_string("Read_from_socket: %s", strerror(-res));
+    success = FALSE;
+  }
+
+  if (!success)
+  {
+    net_hangup(dsock);
+    return;
+  }
+
+  /*
+   * The kernel stopped the multishot recv, so start it again. If
+   * it ran out of buffers, we wait until the buffers it filled
+   * have been handed back, which they are by the next poll.
+   */
+  if (conn->recv_armed)
+    return;
+
+  if (res == -ENOBUFS)
+    uring_wait(ring, conn);
+  else
+    uring_arm_recv(ring, conn);
+}
+
+void uring_handle_send(URING *ring, URING_CONN *conn, int res)
+{
+  conn->inflight--;
+  conn->sending = FALSE;
+
+  if (conn->dsock == NULL)
+  {
+    uring_release(ring, conn);
+    return;
+  }
+
+  if (res < 0)
+  {
+    if (res == -EAGAIN || res == -EINTR)
+    {
+      uring_start_send(ring, conn);
+      return;
+    }
+
+    log_string("Text_to_socket: %s", strerror(-res));
+    net_hangup(conn->dsock);
+    return;
+  }
+
+  /* the kernel has the data now */
+  __atomic_sub_fetch(&conn->dsock->send_depth, res, __ATOMIC_RELAXED);
+
+  conn->send_off += res;
+
+  /* send the rest, or whatever was queued in the meantime */
+  uring_start_send(ring, conn);
+
+  /* there is room again, for output we could not take before */
+  if (conn->dsock->send_first != NULL)
+    net_writable(conn->dsock);
+}
+
+/*
+ * Uring_reap()
+ *
+ * Handles every completion the kernel has posted.
+ */
+void uring_reap(URING *ring)
+{
+  for (;;)
+  {
+    struct io_uring_cqe *cqe;
+    unsigned head, flags;
+    unsigned long data;
+    int res;
+
+    head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+      break;
+
+    cqe   = &ring->cqes[head & *ring->cq_mask];
+    data  = cqe->user_data;
+    res   = cqe->res;
+    flags = cqe->flags;
+
+    /* release the entry before we act on it, since we may queue more work */
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+
+    switch(data & URING_OP_MASK)
+    {
+      default:
+        break;
+      case URING_OP_ACCEPT:
+        uring_handle_accept(ring, (int) (data >> 3), res, flags);
+        break;
+      case URING_OP_RECV:
+        uring_handle_recv(ring, (URING_CONN *) (data & ~URING_OP_MASK), res, flags);
+        break;
+      case URING_OP_SEND:
+        uring_handle_send(ring, (URING_CONN *) (data & ~URING_OP_MASK), res);
+        break;
+      case URING_OP_WAKE:
+        uring_handle_wake(ring, flags);
+        break;
+      case URING_OP_TIMER:
+        uring_handle_timer(ring, flags);
+        break;
+    }
+  }
+}
+
+/*
+ * Uring_poll()
+ *
+ * Submits anything pending, waits up to timeout milliseconds
+ * for completions, and handles all of them.
+ */
+void uring_poll(URING *ring, int timeout)
+{
+  unsigned pending;
+  int i;
+
+  for (i = 0; i < ring->listener_count; i++)
+  {
+    if (!ring->accept_armed[i])
+      uring_arm_accept(ring, i);
+  }
+  if (!ring->wake_armed)
+    uring_arm_wake(ring);
+  if (ring->timer_fd >= 0 && !ring->timer_armed)
+    uring_arm_timer(ring);
+  if (ring->waiting != NULL)
+    uring_restart(ring);
+
+  /* completions that did not fit in the queue are flushed on enter */
+  if (__atomic_load_n(ring->sq_flags, __ATOMIC_RELAXED) & IORING_SQ_CQ_OVERFLOW)
+    uring_enter(ring, 0, 0, IORING_ENTER_GETEVENTS, 0);
+
+  pending = ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+  if (timeout != 0 && *ring->cq_head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+  {
+    if (uring_enter(ring, pending, 1, 0, timeout) < 0 && errno != EINTR && errno != ETIME && errno != EBUSY)
+      perror("Uring_poll");
+  }
+  else if (pending > 0)
+    uring_submit(ring);
+
+  uring_reap(ring);
+}
+
+/*
+ * Uring_flush()
+ *
+ * Waits until all queued output has been handed to the
+ * kernel, or until timeout milliseconds have passed.
+ */
+void uring_flush(URING *ring, int timeout)
+{
+  struct timespec start, now;
+  URING_CONN *conn;
+  int i, busy;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  for (;;)
+  {
+    /* output the ring could not take is handed over as sends complete */
+    for (i = 0, busy = 0; i < ring->conns_size; i++)
+    {
+      if ((conn = ring->conns[i]) == NULL)
+        continue;
+
+      if (conn->sending || (conn->dsock && !conn->dsock->hangup && conn->dsock->send_first))
+        busy++;
+    }
+    if (busy == 0)
+      break;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if ((now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000 >= timeout)
+      break;
+
+    uring_poll(ring, 10);
+  }
+}
@@ -37,23 +37,19 @@ void clear_mobile(D_MOBILE *dMob)
   dMob->name         =  NULL;
   dMob->password     =  NULL;
   dMob->level        =  LEVEL_PLAYER;
-  dMob->events       =  AllocList();
+  dMob->events       =  NULL;
 }
 
 void free_mobile(D_MOBILE *dMob)
 {
   EVENT_DATA *pEvent;
-  ITERATOR Iter;
 
   DetachFromList(dMob, dmobile_list);
 
   if (dMob->socket) dMob->socket->player = NULL;
 
-  AttachIterator(&Iter, dMob->events);
-  while ((pEvent = (EVENT_DATA *) NextInList(&Iter)) != NULL)
+  while ((pEvent = dMob->events) != NULL)
     dequeue_event(pEvent);
-  DetachIterator(&Iter);
-  FreeList(dMob->events);
 
   /* free allocated memory */
   free(dMob->name);
@@ -66,6 +62,7 @@ void communicate(D_MOBILE *dMob, char *txt, int range)
 {
   D_MOBILE *xMob;
   ITERATOR Iter;
+  SEGMENT *seg;
   char buf[MAX_BUFFER];
   char message[MAX_BUFFER];
 
@@ -78,23 +75,27 @@ void communicate(D_MOBILE *dMob, char *txt, int range)
       snprintf(message, MAX_BUFFER, "%s says '%s'.\n\r", dMob->name, txt);
       snprintf(buf, MAX_BUFFER, "You say '%s'.\n\r", txt);
       text_to_mobile(dMob, buf);
+      seg = render_segment(message);
       AttachIterator(&Iter, dmobile_list);
       while ((xMob = (D_MOBILE *) NextInList(&Iter)) != NULL)
       {
         if (xMob == dMob) continue;
-        text_to_mobile(xMob, message);
+        segment_to_mobile(xMob, seg);
       }
       DetachIterator(&Iter);
+      free_segment(seg);
       break;
     case COMM_LOG:
       snprintf(message, MAX_BUFFER, "[LOG: %s]\n\r", txt);
+      seg = render_segment(message);
       AttachIterator(&Iter, dmobile_list);
       while ((xMob = (D_MOBILE *) NextInList(&Iter)) != NULL)
       {
         if (!IS_ADMIN(xMob)) continue;
-        text_to_mobile(xMob, message);
+        segment_to_mobile(xMob, seg);
       }
       DetachIterator(&Iter);
+      free_segment(seg);
       break;
   }
 }
@@ -108,7 +109,38 @@ void load_muddata(bool fCopyOver)
 
   /* copyover */
   if (fCopyOver)
+  {
+    load_dns_cache();
     copyover_recover();
+  }
+}
+
+/*
+ * Number_range()
+ *
+ * Returns a random number from `from' to `to', both included.
+ */
+int number_range(int from, int to)
+{
+  if (to <= from)
+    return from;
+
+  return from + rand() % (to - from + 1);
+}
+
+/*
+ * Update_time()
+ *
+ * Reads the clocks once for each pass of the game loop, so
+ * everything else can use current_time and current_mono.
+ */
+void update_time()
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  current_mono = (long long) now.tv_sec * 1000000000LL + now.tv_nsec;
+  current_time = time(NULL);
 }
 
 char *get_time()
@@ -157,6 +189,9 @@ void copyover_recover()
   
     dsock->hostname     =  strdup(host);
     AttachToList(dsock, dsock_list);
+
+    /* hand the socket to a network thread */
+    net_attach(dsock);
  
     /* load player data */
     if ((dMob = load_player(name)) != NULL)